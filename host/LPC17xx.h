@@ -0,0 +1,87 @@
+/*
+ * LPC17xx.h
+ *
+ * Host stand-in for the CMSIS device header. It exposes the peripherals the
+ * verification code touches (GPDMA, SC, NVIC) as simulated register blocks
+ * that sim.c services from a separate thread, and maps flash to an image file.
+ */
+
+#ifndef LPC17XX_HOST_H_
+#define LPC17XX_HOST_H_
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#define __I volatile const
+#define __O volatile
+#define __IO volatile
+
+/* flash is the mmap'd image, see sim_flash_open */
+extern uintptr_t sim_flash_base;
+#define FLASH_BASE sim_flash_base
+#define FLASH_SIZE (512 * 1024)
+
+/* GPDMA controller registers */
+typedef struct {
+	__I uint32_t DMACIntStat;
+	__I uint32_t DMACIntTCStat;
+	__O uint32_t DMACIntTCClear;
+	__I uint32_t DMACIntErrStat;
+	__O uint32_t DMACIntErrClr;
+	__I uint32_t DMACRawIntTCStat;
+	__I uint32_t DMACRawIntErrStat;
+	__I uint32_t DMACEnbldChns;
+	__IO uint32_t DMACSoftBReq;
+	__IO uint32_t DMACSoftSReq;
+	__IO uint32_t DMACSoftLBReq;
+	__IO uint32_t DMACSoftLSReq;
+	__IO uint32_t DMACConfig;
+	__IO uint32_t DMACSync;
+} LPC_GPDMA_TypeDef;
+
+/* GPDMA channel registers (addresses are pointer sized on the host) */
+typedef struct {
+	__IO uintptr_t DMACCSrcAddr;
+	__IO uintptr_t DMACCDestAddr;
+	__IO uintptr_t DMACCLLI;
+	__IO uint32_t DMACCControl;
+	__IO uint32_t DMACCConfig;
+} LPC_GPDMACH_TypeDef;
+
+/* system control registers */
+typedef struct {
+	__IO uint32_t PCONP;
+	__IO uint32_t PCLKSEL0;
+	__IO uint32_t PCLKSEL1;
+} LPC_SC_TypeDef;
+
+extern LPC_GPDMA_TypeDef sim_gpdma;
+extern LPC_GPDMACH_TypeDef sim_gpdma_channels[8];
+extern LPC_SC_TypeDef sim_sc;
+
+#define LPC_GPDMA		(&sim_gpdma)
+#define LPC_GPDMACH0	(&sim_gpdma_channels[0])
+#define LPC_GPDMACH1	(&sim_gpdma_channels[1])
+#define LPC_GPDMACH2	(&sim_gpdma_channels[2])
+#define LPC_GPDMACH3	(&sim_gpdma_channels[3])
+#define LPC_GPDMACH4	(&sim_gpdma_channels[4])
+#define LPC_GPDMACH5	(&sim_gpdma_channels[5])
+#define LPC_GPDMACH6	(&sim_gpdma_channels[6])
+#define LPC_GPDMACH7	(&sim_gpdma_channels[7])
+#define LPC_SC			(&sim_sc)
+
+/* interrupts, only the DMA interrupt is simulated */
+typedef enum {
+	DMA_IRQn = 26,
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+
+extern uint32_t SystemCoreClock;
+
+/* let the simulated GPDMA thread run while the CPU waits on it */
+#define CPU_RELAX() sched_yield()
+
+#endif /* LPC17XX_HOST_H_ */
@@ -0,0 +1,279 @@
+/*
+ * build_archive.c
+ *
+ * Build an archive on the host in the format generator_init writes on the board:
+ * the header block at HEADER_OFFSET, the parts (hash followed by data) from
+ * PART_STARTING_OFFSET on and the end section (footer, and the Merkle tree of a
+ * tree archive). The payload is either the seeded random payload of the board or
+ * the concatenation of input files, chunked into parts of a chosen size. Parts
+ * are generated and hashed across all cores, with the digest chosen by -H.
+ *
+ * The output is the archive region, to be programmed at HEADER_OFFSET, or with
+ * -f a whole flash image (for verify_bench and stream_verify).
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "md5.h"
+#include "payload_generator.h"
+#include "definitions.h"
+#include "merkle.h"
+#include "digest.h"
+
+#define MAX_THREADS 64
+
+/* the archive has to end before the verification log sector */
+#define ARCHIVE_LIMIT FLASH_SECTOR_29_ADDRESS
+
+/* parts hashed by a worker, [first, first + count) */
+typedef struct {
+	pthread_t thread;
+	uint8_t* image;
+	uint32_t part_size;
+	uint32_t first;
+	uint32_t count;
+	int seeded;					/* generate the data first, as write_payload does */
+	const digest_backend* digest;
+} build_range;
+
+/**
+* Worker: fill (when seeded) and hash a range of parts
+*/
+static void* build_run(void* arg) {
+	build_range* range = (build_range*) arg;
+	uint32_t pieces = FLASH_BLOCK_SIZE_4K / range->part_size, i, address;
+	uint8_t* part;
+
+	for (i=range->first; i<range->first + range->count; i++) {
+		address = PART_STARTING_OFFSET + i * range->part_size;
+		part = range->image + address;
+
+		/* a part is seeded with the address of its 4K block plus its index in it */
+		if (range->seeded)
+			seed_payload(part + HASH_SIZE, range->part_size - HASH_SIZE,
+					address - (i % pieces) * range->part_size + i % pieces);
+		range->digest->digest(part + HASH_SIZE, range->part_size - HASH_SIZE, part);
+	}
+	return NULL;
+}
+
+/**
+* Read the input files into the payload, padding the last part with zeros
+*
+* @param image		Flash image
+* @param part_size	Size of a part, its hash included
+* @param files		Input files
+* @param no_files	Number of input files
+*
+* @return number of parts, 0 on failure
+*/
+static uint32_t read_inputs(uint8_t* image, uint32_t part_size, char* files[], int no_files) {
+	uint32_t data_size = part_size - HASH_SIZE, used = 0, parts = 0, limit, length;
+	FILE* input;
+	int i;
+
+	limit = (ARCHIVE_LIMIT - PART_STARTING_OFFSET) / part_size;
+	for (i=0; i<no_files; i++) {
+		input = (strcmp(files[i], "-"))? fopen(files[i], "rb") : stdin;
+		if (!input) {
+			perror(files[i]);
+			return 0;
+		}
+
+		/* the data of a part follows its hash */
+		while (parts < limit) {
+			length = fread(image + PART_STARTING_OFFSET + parts * part_size + HASH_SIZE + used,
+					1, data_size - used, input);
+			if (!length) break;
+			used += length;
+			if (used == data_size) {
+				parts++;
+				used = 0;
+			}
+		}
+		if (ferror(input) || (parts == limit && fgetc(input) != EOF)) {
+			fprintf(stderr, "%s: does not fit the archive\n", files[i]);
+			return 0;
+		}
+		if (input != stdin) fclose(input);
+	}
+
+	if (used) {
+		memset(image + PART_STARTING_OFFSET + parts * part_size + HASH_SIZE + used, 0, data_size - used);
+		parts++;
+	}
+	return parts;
+}
+
+/**
+* Write the end section after the parts, as write_end and write_merkle_end do:
+* a flat archive ends with a part worth of footer bytes, a tree archive with the
+* footer followed by the interior nodes, level by level. The section is padded
+* with zeros to a whole 4K block.
+*
+* @param image		Flash image
+* @param parts		Number of parts
+* @param part_size	Size of a part, its hash included
+* @param root		Where the root of a tree archive is stored, 0 for a flat archive
+*
+* @return offset right after the end section, 0 if it does not fit
+*/
+static uint32_t build_end(uint8_t* image, uint16_t parts, uint32_t part_size, uint8_t* root) {
+	uint32_t end = PART_STARTING_OFFSET + (uint32_t)parts * part_size;
+	merkle_tree tree;
+	uint16_t index;
+	uint8_t level;
+
+	if (!root) {
+		if (end + part_size > ARCHIVE_LIMIT) return 0;
+		memset(image + end, FLASH_USER_END_BLOCK_DATA, part_size);
+		end += part_size;
+	}
+	else {
+		merkle_layout(&tree, parts, part_size);
+		if (tree.nodes_offset + tree.nodes_count * HASH_SIZE > ARCHIVE_LIMIT) return 0;
+		memset(image + end, FLASH_USER_END_BLOCK_DATA, ARCHIVE_FOOTER_SIZE);
+
+		memcpy(root, image + merkle_node_offset(&tree, 0, 0), HASH_SIZE);
+		for (level=1; level<tree.levels; level++)
+			for (index=0; index<tree.size[level]; index++) {
+				merkle_combine(image + merkle_node_offset(&tree, level - 1, 2 * index),
+						(2 * index + 1 < tree.size[level - 1])?
+								image + merkle_node_offset(&tree, level - 1, 2 * index + 1) : 0,
+						image + merkle_node_offset(&tree, level, index));
+				memcpy(root, image + merkle_node_offset(&tree, level, index), HASH_SIZE);
+			}
+		end = tree.nodes_offset + tree.nodes_count * HASH_SIZE;
+	}
+
+	/* pad to a whole block */
+	while (end % FLASH_BLOCK_SIZE_4K)
+		image[end++] = 0;
+	return end;
+}
+
+/**
+* main function
+*/
+int main(int argc, char* argv[]) {
+	static uint8_t image[FLASH_SIZE];
+	build_range ranges[MAX_THREADS];
+	uint8_t root[HASH_SIZE];
+	uint32_t part_size = PAYLOAD_BLOCK_SIZE, parts, end, first;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), full = 0, merkle = 0, legacy = 0, opt, i;
+	e_digest_algorithm algorithm = DIGEST_MD5;
+	const char* output = 0;
+	uint64_t start;
+	FILE* out;
+
+	while ((opt = getopt(argc, argv, "fH:j:mo:rs:")) != -1)
+		switch (opt) {
+		case 'f': full = 1; break;
+		case 'H':
+			for (algorithm=0; algorithm<DIGEST_ALGORITHMS; algorithm++)
+				if (!strcmp(optarg, digest_backend_of(algorithm)->name)) break;
+			if (algorithm == DIGEST_ALGORITHMS) {
+				fprintf(stderr, "%s: unknown digest %s\n", argv[0], optarg);
+				return 2;
+			}
+			break;
+		case 'j': threads = atoi(optarg); break;
+		case 'm': merkle = 1; break;
+		case 'o': output = optarg; break;
+		case 'r': legacy = 1; break;
+		case 's': part_size = atoi(optarg) + HASH_SIZE; break;
+		default:
+			fprintf(stderr, "usage: %s [-f] [-H digest] [-j threads] [-m] [-r] [-s bytes] -o output [file...]\n"
+					"  -f  write a whole flash image instead of the archive region at 0x%x\n"
+					"  -H  digest of the parts: md5 (default), crc32 or sha256\n"
+					"  -j  hashing threads (default: one per core)\n"
+					"  -m  write a Merkle archive\n"
+					"  -r  seed the payload with newlib's rand, as older builds did (one thread)\n"
+					"  -s  data bytes per part (default %d)\n"
+					"  Without files the seeded random payload of generator_init is written;\n"
+					"  files (- for stdin) are concatenated and the last part padded with zeros.\n",
+					argv[0], HEADER_OFFSET, PAYLOAD_SIZE_BYTES);
+			return 2;
+		}
+	if (!output) {
+		fprintf(stderr, "%s: no output given (-o)\n", argv[0]);
+		return 2;
+	}
+	if (threads < 1) threads = 1;
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	/* newlib's rand keeps one global state */
+	if (legacy) threads = 1;
+
+	memset(image, SIM_FLASH_ERASED, sizeof(image));
+	digest_select(algorithm);
+	generator_set_prng((legacy)? PAYLOAD_PRNG_NEWLIB : PAYLOAD_PRNG_DEFAULT);
+
+	/* the seeded payload tiles the payload sectors with parts, as write_payload does */
+	if (optind == argc) {
+		if (part_size <= HASH_SIZE || FLASH_BLOCK_SIZE_4K % part_size) {
+			fprintf(stderr, "%s: seeded parts must tile a 4K block (240, 496, 1008 or 2032 bytes)\n", argv[0]);
+			return 2;
+		}
+		parts = ((sector_start_address[FLASH_USER_END_SECTOR] - sector_start_address[FLASH_USER_PAYLOAD_START_SECTOR]) /
+				FLASH_BLOCK_SIZE_4K) * (FLASH_BLOCK_SIZE_4K / part_size);
+	}
+	else {
+		if (part_size <= HASH_SIZE || part_size & 0x03) {
+			fprintf(stderr, "%s: part data must be a positive multiple of 4 bytes\n", argv[0]);
+			return 2;
+		}
+		parts = read_inputs(image, part_size, &argv[optind], argc - optind);
+		if (!parts) return 2;
+	}
+	if (parts > 0xFFFF) {
+		fprintf(stderr, "%s: %u parts do not fit the header\n", argv[0], parts);
+		return 2;
+	}
+
+	/* hash the parts across the threads */
+	start = sim_nanoseconds();
+	if ((uint32_t) threads > parts) threads = parts;
+	for (i=0, first=0; i<threads; i++) {
+		ranges[i].image = image;
+		ranges[i].part_size = part_size;
+		ranges[i].first = first;
+		ranges[i].count = parts / threads + ((uint32_t) i < parts % threads);
+		ranges[i].seeded = optind == argc;
+		ranges[i].digest = digest_selected();
+		first += ranges[i].count;
+		if (pthread_create(&ranges[i].thread, NULL, build_run, &ranges[i])) {
+			perror("pthread_create");
+			return 2;
+		}
+	}
+	for (i=0; i<threads; i++)
+		pthread_join(ranges[i].thread, NULL);
+
+	end = build_end(image, parts, part_size, (merkle)? root : 0);
+	if (!end) {
+		fprintf(stderr, "%s: the end section does not fit before the log sector\n", argv[0]);
+		return 2;
+	}
+	memset(image + HEADER_OFFSET, 0, PART_STARTING_OFFSET - HEADER_OFFSET);
+	build_header(image + HEADER_OFFSET, parts, part_size, (merkle)? root : 0, algorithm);
+
+	out = fopen(output, "wb");
+	if (!out) {
+		perror(output);
+		return 2;
+	}
+	if ((full && fwrite(image, 1, FLASH_SIZE, out) != FLASH_SIZE) ||
+			(!full && fwrite(image + HEADER_OFFSET, 1, end - HEADER_OFFSET, out) != end - HEADER_OFFSET)) {
+		perror(output);
+		return 2;
+	}
+	fclose(out);
+
+	printf("%s: %u parts of %u bytes (%s), %u B archive, %d threads  %.3f ms\n", output, parts, part_size,
+			digest_selected()->name, end - HEADER_OFFSET, threads, (double) (sim_nanoseconds() - start) / 1e6);
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*
+ * cr_section_macros.h
+ *
+ * Host stand-in for the Code Red section placement macros, the host linker
+ * places everything in ordinary RAM.
+ */
+
+#ifndef CR_SECTION_MACROS_HOST_H_
+#define CR_SECTION_MACROS_HOST_H_
+
+#define __DATA(bank)
+#define __BSS(bank)
+#define __NOINIT(bank)
+#define __NOINIT_DEF
+#define __RAMFUNC(bank)
+
+#endif /* CR_SECTION_MACROS_HOST_H_ */
@@ -0,0 +1,285 @@
+/*
+ * image_verify.c
+ *
+ * Multi-threaded verification of archive images on the host. The parts are split
+ * evenly between the workers; a worker hashes IMAGE_CHUNK_PARTS parts at a time
+ * from the front of its range, and once its range is empty it steals the back
+ * half of the largest range left, so no core idles while parts remain.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image_verify.h"
+
+/* parts [next, end) still to be hashed by a worker; the owner takes from the
+ * front, thieves split off the back */
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t next;
+	uint32_t end;
+} image_queue;
+
+/* state shared by the workers of one verification */
+typedef struct {
+	image_queue queues[IMAGE_MAX_THREADS];
+	int threads;
+	uint8_t* parts;				/* first part in the mapping */
+	const digest_backend* digest;	/* digest named in the header */
+	uint32_t part_size;
+	uint8_t* bad;				/* byte n is set if part n does not match its hash */
+	pthread_mutex_t bad_lock;
+	volatile uint32_t first_bad;	/* lowest bad part found; unless every part is
+								 * scanned, parts past it are skipped */
+	uint8_t scan_all;
+} image_job;
+
+/* a worker and the job it belongs to */
+typedef struct {
+	pthread_t thread;
+	image_job* job;
+	int index;
+} image_worker;
+
+/**
+* Map an archive image read-only
+*
+* @param image		Where the mapping is described
+* @param path		Image file
+*
+* @return 0 on success, -1 on failure
+*/
+int image_open(archive_image* image, const char* path) {
+	struct stat st;
+	int fd;
+
+	memset(image, 0, sizeof(*image));
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if (st.st_size < 8 || st.st_size > FLASH_SIZE) {
+		fprintf(stderr, "%s: not an archive image\n", path);
+		close(fd);
+		return -1;
+	}
+
+	image->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image->data == MAP_FAILED) {
+		perror(path);
+		image->data = 0;
+		return -1;
+	}
+	image->size = st.st_size;
+
+	/* a whole flash image carries its header at HEADER_OFFSET, an archive region
+	 * starts with it */
+	image->base = (image->size >= PART_STARTING_OFFSET &&
+			get_two_bytes(image->data + HEADER_OFFSET) == VALID_PREAMBLE)? 0 : HEADER_OFFSET;
+	return 0;
+}
+
+/**
+* Unmap an archive image
+*
+* @param image		Mapped image
+*/
+void image_close(archive_image* image) {
+	if (image->data) munmap(image->data, image->size);
+	image->data = 0;
+}
+
+/**
+* Parts of a range still worth hashing: once a bad part is found and not every
+* part is scanned, only parts below it can change the report
+*
+* @param job		Verification job
+* @param queue		Range
+*
+* @return number of parts
+*/
+static uint32_t image_left(image_job* job, image_queue* queue) {
+	return (queue->next < job->first_bad)? queue->end - queue->next : 0;
+}
+
+/**
+* Take the next parts for a worker: a chunk from the front of its own range, or
+* else the back half of the largest range of another worker
+*
+* @param job		Verification job
+* @param index		Worker taking parts
+* @param first		Where the first part taken is stored
+*
+* @return number of parts taken, 0 when none are left
+*/
+static uint32_t image_take(image_job* job, int index, uint32_t* first) {
+	image_queue* own = &job->queues[index];
+	image_queue* victim;
+	uint32_t count, largest, left;
+	int i, best;
+
+	for (;;) {
+		pthread_mutex_lock(&own->lock);
+		count = image_left(job, own);
+		if (count) {
+			if (count > IMAGE_CHUNK_PARTS) count = IMAGE_CHUNK_PARTS;
+			*first = own->next;
+			own->next += count;
+			pthread_mutex_unlock(&own->lock);
+			return count;
+		}
+		pthread_mutex_unlock(&own->lock);
+
+		/* steal from whoever has the most left (read without locks, then checked) */
+		best = -1;
+		largest = 0;
+		for (i=0; i<job->threads; i++) {
+			left = image_left(job, &job->queues[i]);
+			if (i != index && left > largest) {
+				largest = left;
+				best = i;
+			}
+		}
+		if (best < 0) return 0;
+
+		victim = &job->queues[best];
+		pthread_mutex_lock(&victim->lock);
+		left = image_left(job, victim);
+		if (left) {
+			count = (left + 1) / 2;
+			victim->end -= count;
+			pthread_mutex_lock(&own->lock);
+			own->next = victim->end;
+			own->end = victim->end + count;
+			pthread_mutex_unlock(&own->lock);
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+}
+
+/**
+* Worker: hash parts until none are left, marking the bad ones. The parts taken
+* together are hashed as one batch (side by side in the vector lanes for MD5).
+*/
+static void* image_run(void* arg) {
+	image_worker* worker = (image_worker*) arg;
+	image_job* job = worker->job;
+	uint8_t digests[IMAGE_CHUNK_PARTS][HASH_SIZE];
+	const void* data[IMAGE_CHUNK_PARTS];
+	uint8_t* results[IMAGE_CHUNK_PARTS];
+	uint8_t* part;
+	uint32_t first, count, i;
+
+	while ((count = image_take(job, worker->index, &first))) {
+		for (i=0; i<count; i++) {
+			data[i] = job->parts + (first + i) * job->part_size + HASH_SIZE;
+			results[i] = digests[i];
+		}
+		digest_batch(job->digest, data, job->part_size - HASH_SIZE, results, count);
+
+		for (i=0; i<count; i++) {
+			part = job->parts + (first + i) * job->part_size;
+			if (memcmp(digests[i], part, HASH_SIZE)) {
+				job->bad[first + i] = 1;
+				if (!job->scan_all) {
+					pthread_mutex_lock(&job->bad_lock);
+					if (first + i < job->first_bad) job->first_bad = first + i;
+					pthread_mutex_unlock(&job->bad_lock);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+* Verify an archive image with a pool of threads. The header and footer are
+* checked as verify checks them; bad parts are reported in part order. Without
+* scan_all the workers stop once every part below the lowest bad part found is
+* hashed, so the first bad part reported is the lowest one, as verify reports it.
+* Flash reads go to the image, so one image is verified at a time.
+*
+* @param image		Mapped image
+* @param threads	Worker threads (at most IMAGE_MAX_THREADS)
+* @param result		Where the report is stored, scan_all set up by the caller
+*
+* @return archive is valid or archive is not valid
+*/
+uint8_t image_verify(archive_image* image, int threads, verify_result* result) {
+	image_worker workers[IMAGE_MAX_THREADS];
+	image_job job;
+	uint8_t digest[HASH_SIZE];
+	uint32_t part_size, first, i;
+	uint16_t no_parts;
+	int started;
+
+	sim_flash_base = (uintptr_t) image->data - image->base;
+
+	/* the header and the footer have to be inside the image */
+	if (image->base + image->size < PART_STARTING_OFFSET) {
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
+	part_size = get_part_size();
+	no_parts = get_number_of_parts();
+	if (part_size <= HASH_SIZE || !no_parts ||
+			PART_STARTING_OFFSET + (uint64_t)no_parts * part_size + ARCHIVE_FOOTER_SIZE > image->base + image->size) {
+		result->status = (get_preamble() == VALID_PREAMBLE)? VERIFY_BAD_LAYOUT : VERIFY_BAD_PREAMBLE;
+		return 0;
+	}
+	if (!check_header(result, part_size, no_parts)) return 0;
+
+	/* split the parts evenly, the workers balance the rest by stealing */
+	if (threads < 1) threads = 1;
+	if (threads > IMAGE_MAX_THREADS) threads = IMAGE_MAX_THREADS;
+	memset(&job, 0, sizeof(job));
+	job.threads = threads;
+	job.parts = image->data + PART_STARTING_OFFSET - image->base;
+	job.part_size = part_size;
+	job.digest = digest_selected();
+	job.scan_all = result->scan_all;
+	job.first_bad = no_parts;
+	pthread_mutex_init(&job.bad_lock, NULL);
+	job.bad = calloc(no_parts, 1);
+	if (!job.bad) {
+		pthread_mutex_destroy(&job.bad_lock);
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
+	for (i=0, first=0; i<(uint32_t) threads; i++) {
+		pthread_mutex_init(&job.queues[i].lock, NULL);
+		job.queues[i].next = first;
+		first += no_parts / threads + (i < no_parts % threads);
+		job.queues[i].end = first;
+	}
+
+	/* workers that run steal the ranges of any that could not be started */
+	for (started=0; started<threads; started++) {
+		workers[started].job = &job;
+		workers[started].index = started;
+		if (pthread_create(&workers[started].thread, NULL, image_run, &workers[started])) break;
+	}
+	if (!started) image_run(&workers[0]);
+	for (i=0; i<(uint32_t) started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	/* report the bad parts in order, as a single core would have found them */
+	for (i=0; i<no_parts; i++)
+		if (job.bad[i]) {
+			calculate_part_hash(job.parts + i * part_size, part_size - HASH_SIZE, digest);
+			if (!record_bad_part(result, i, job.parts + i * part_size, digest, part_size)) break;
+		}
+
+	for (i=0; i<(uint32_t) threads; i++)
+		pthread_mutex_destroy(&job.queues[i].lock);
+	pthread_mutex_destroy(&job.bad_lock);
+	free(job.bad);
+	return result->status == VERIFY_OK;
+}
@@ -0,0 +1,36 @@
+/*
+ * image_verify.h
+ *
+ * Verification of archive images on the host with every core: the image is
+ * mapped read-only in place of flash, the header and footer are parsed by the
+ * same functions verify uses, and parts are hashed by a pool of threads that
+ * steal work from each other.
+ */
+
+#ifndef IMAGE_VERIFY_H_
+#define IMAGE_VERIFY_H_
+
+#include "sim.h"
+#include "definitions.h"
+#include "merkle.h"
+#include "digest.h"
+
+/* worker threads at most, and parts a worker hashes between looks at the queues
+ * (one digest batch, as many as the widest MD5 kernel has lanes) */
+#define IMAGE_MAX_THREADS 64
+#define IMAGE_CHUNK_PARTS MD5_MAX_LANES
+
+/* a mapped archive image: either a whole flash image or the archive region
+ * written from HEADER_OFFSET on (as build_archive writes it) */
+typedef struct {
+	uint8_t* data;
+	uint32_t size;
+	uint32_t base;			/* flash offset of the first byte */
+} archive_image;
+
+/* definitions of functions */
+int image_open(archive_image* image, const char* path);
+void image_close(archive_image* image);
+uint8_t image_verify(archive_image* image, int threads, verify_result* result);
+
+#endif /* IMAGE_VERIFY_H_ */
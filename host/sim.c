@@ -0,0 +1,349 @@
+/*
+ * sim.c
+ *
+ * Host simulation of flash, the GPDMA controller, the NVIC and the cycle counter.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "definitions.h"
+#include "timer.h"
+
+/* channel control and configuration bits the simulation honours */
+#define CONTROL_SIZE(control)	((control) & 0xFFF)
+#define CONTROL_SI				(1UL << 26)
+#define CONTROL_DI				(1UL << 27)
+#define CONTROL_I				(1UL << 31)
+#define CONFIG_E				(1UL << 0)
+#define CONFIG_ITC				(1UL << 15)
+
+/* write access to registers the CPU only reads */
+#define SIM_REG(reg) (*(volatile uint32_t*) &(reg))
+
+void DMA_IRQHandler(void);
+
+/* simulated peripherals */
+LPC_GPDMA_TypeDef sim_gpdma;
+LPC_GPDMACH_TypeDef sim_gpdma_channels[8];
+LPC_SC_TypeDef sim_sc;
+uint32_t SystemCoreClock = SIM_CYCLES_PER_SECOND;
+
+/* flash image */
+uintptr_t sim_flash_base;
+static int flash_fd = -1;
+
+/* GPDMA thread and interrupt state: the handler runs with irq_lock held, so
+ * masking the interrupt waits for a running handler, as it would on the core */
+static pthread_t gpdma_thread;
+static volatile int running = 0;
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_unmasked = PTHREAD_COND_INITIALIZER;
+static int irq_enabled = 0;
+
+/* terminal counts latched before the interrupt is delivered, 0 to deliver each
+ * one before the channel moves on; interrupts pending while coalescing */
+static int coalesce = 0;
+static int pending = 0;
+
+/* time base of timer_cycles */
+static uint64_t timer_epoch;
+
+/**
+* Get the monotonic clock
+*
+* @return nanoseconds since an arbitrary point
+*/
+uint64_t sim_nanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * SIM_CYCLES_PER_SECOND + now.tv_nsec;
+}
+
+/**
+* Start counting host cycles (nanoseconds)
+*/
+void timer_init() {
+	timer_epoch = sim_nanoseconds();
+}
+
+/**
+* Get the number of host cycles counted since timer_init
+*
+* @return the 32-bit cycle count
+*/
+uint32_t timer_cycles() {
+	return (uint32_t)(sim_nanoseconds() - timer_epoch);
+}
+
+/**
+* Enable an interrupt, delivering one that is pending
+*
+* @param irq	Interrupt number
+*/
+void NVIC_EnableIRQ(IRQn_Type irq) {
+	pthread_mutex_lock(&irq_lock);
+	irq_enabled = 1;
+	pthread_cond_broadcast(&irq_unmasked);
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/**
+* Disable an interrupt, waiting for its handler if it is running
+*
+* @param irq	Interrupt number
+*/
+void NVIC_DisableIRQ(IRQn_Type irq) {
+	pthread_mutex_lock(&irq_lock);
+	irq_enabled = 0;
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/**
+* Map a flash image, creating it erased when it does not exist
+*
+* @param path	Image file
+*
+* @return 0 on success, -1 on failure
+*/
+int sim_flash_open(const char* path) {
+	struct stat st;
+	void* image;
+	uint8_t erased[4096];
+	off_t size;
+
+	flash_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (flash_fd < 0 || fstat(flash_fd, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	/* grow a new or short image with erased flash */
+	memset(erased, SIM_FLASH_ERASED, sizeof(erased));
+	for (size = st.st_size; size < FLASH_SIZE; size += sizeof(erased))
+		if (pwrite(flash_fd, erased, sizeof(erased), size) != sizeof(erased)) {
+			perror(path);
+			return -1;
+		}
+
+	image = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flash_fd, 0);
+	if (image == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	sim_flash_base = (uintptr_t) image;
+	return 0;
+}
+
+/**
+* Write the flash image back and unmap it
+*/
+void sim_flash_close() {
+	if (!sim_flash_base) return;
+	msync((void*) sim_flash_base, FLASH_SIZE, MS_SYNC);
+	munmap((void*) sim_flash_base, FLASH_SIZE);
+	close(flash_fd);
+	sim_flash_base = 0;
+	flash_fd = -1;
+}
+
+/**
+* Apply the interrupt clear registers and update the combined status
+*/
+static void gpdma_clear() {
+	SIM_REG(sim_gpdma.DMACIntTCStat) &= ~sim_gpdma.DMACIntTCClear;
+	SIM_REG(sim_gpdma.DMACIntErrStat) &= ~sim_gpdma.DMACIntErrClr;
+	sim_gpdma.DMACIntTCClear = 0;
+	sim_gpdma.DMACIntErrClr = 0;
+	SIM_REG(sim_gpdma.DMACIntStat) = sim_gpdma.DMACIntTCStat | sim_gpdma.DMACIntErrStat;
+}
+
+/**
+* Raise channel interrupt flags and deliver the interrupt. Unless coalescing, the
+* channel waits while the interrupt is masked and every terminal count is handled
+* before it moves on; while coalescing the flags are only latched, so one
+* interrupt can stand for several completed items (see gpdma_deliver).
+*
+* @param tc		Terminal count flags
+* @param err	Error flags
+*/
+static void gpdma_interrupt(uint32_t tc, uint32_t err) {
+	SIM_REG(sim_gpdma.DMACRawIntTCStat) |= tc;
+	SIM_REG(sim_gpdma.DMACRawIntErrStat) |= err;
+	SIM_REG(sim_gpdma.DMACIntTCStat) |= tc;
+	SIM_REG(sim_gpdma.DMACIntErrStat) |= err;
+	SIM_REG(sim_gpdma.DMACIntStat) = sim_gpdma.DMACIntTCStat | sim_gpdma.DMACIntErrStat;
+
+	if (coalesce) {
+		pending++;
+		return;
+	}
+
+	pthread_mutex_lock(&irq_lock);
+	while (!irq_enabled && running)
+		pthread_cond_wait(&irq_unmasked, &irq_lock);
+	if (running) {
+		DMA_IRQHandler();
+		gpdma_clear();
+	}
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/**
+* Deliver the interrupt latched while coalescing, once enough items completed or
+* the controller is idle, and only while the interrupt is enabled; the channels
+* keep moving data meanwhile, as they do on the chip
+*
+* @param idle	No channel is enabled
+*/
+static void gpdma_deliver(int idle) {
+	if (!pending || (pending < coalesce && !idle)) return;
+
+	pthread_mutex_lock(&irq_lock);
+	if (!sim_gpdma.DMACIntStat)
+		pending = 0;
+	else if (irq_enabled && running) {
+		DMA_IRQHandler();
+		gpdma_clear();
+		pending = 0;
+	}
+	pthread_mutex_unlock(&irq_lock);
+}
+
+/**
+* Move the data of the item loaded in a channel
+*
+* @param channel	Channel registers
+*
+* @return 0 on success, 1 on a bus error
+*/
+static int gpdma_move(LPC_GPDMACH_TypeDef* channel) {
+	uint32_t control = channel->DMACCControl;
+	uint8_t width = DMA_CONTROL_WIDTH(control);
+	uint32_t items = CONTROL_SIZE(control);
+	uint8_t* src = (uint8_t*) channel->DMACCSrcAddr;
+	uint8_t* dest = (uint8_t*) channel->DMACCDestAddr;
+	uint32_t i;
+
+	if (!src || !dest || width > WORD_WIDTH) return 1;
+
+	if ((control & CONTROL_SI) && (control & CONTROL_DI)) {
+		memcpy(dest, src, items << width);
+		return 0;
+	}
+
+	/* peripheral style transfers keep one side in place */
+	for (i=0; i<items; i++) {
+		memcpy(dest, src, 1 << width);
+		if (control & CONTROL_SI) src += 1 << width;
+		if (control & CONTROL_DI) dest += 1 << width;
+	}
+	return 0;
+}
+
+/**
+* GPDMA controller: move the item of every enabled channel, follow linked list
+* items, raise terminal count interrupts and keep DMACEnbldChns current
+*/
+static void* gpdma_run(void* arg) {
+	LPC_GPDMACH_TypeDef* channel;
+	DMA_LLI* item;
+	uint32_t control, enabled;
+	uint8_t ch, busy;
+
+	while (running) {
+		busy = 0;
+		gpdma_clear();
+
+		for (ch=0; ch<8; ch++) {
+			channel = &sim_gpdma_channels[ch];
+			if (!(sim_gpdma.DMACConfig & 1) || !(channel->DMACCConfig & CONFIG_E)) continue;
+			busy = 1;
+
+			/* a bus error disables the channel */
+			control = channel->DMACCControl;
+			if (gpdma_move(channel)) {
+				channel->DMACCConfig &= ~CONFIG_E;
+				SIM_REG(sim_gpdma.DMACEnbldChns) &= ~(1UL << ch);
+				gpdma_interrupt(0, 1UL << ch);
+				continue;
+			}
+
+			/* load the next item, or finish the chain */
+			if (channel->DMACCLLI) {
+				item = (DMA_LLI*) channel->DMACCLLI;
+				channel->DMACCSrcAddr = item->src_addr;
+				channel->DMACCDestAddr = item->dest_addr;
+				channel->DMACCLLI = item->next_lli;
+				channel->DMACCControl = item->control;
+			}
+			else {
+				channel->DMACCConfig &= ~CONFIG_E;
+				SIM_REG(sim_gpdma.DMACEnbldChns) &= ~(1UL << ch);
+			}
+
+			if ((control & CONTROL_I) && (channel->DMACCConfig & CONFIG_ITC))
+				gpdma_interrupt(1UL << ch, 0);
+		}
+
+		/* channels enabled or disabled by the CPU since the last pass */
+		enabled = 0;
+		for (ch=0; ch<8; ch++)
+			if (sim_gpdma_channels[ch].DMACCConfig & CONFIG_E) enabled |= 1UL << ch;
+		SIM_REG(sim_gpdma.DMACEnbldChns) = enabled;
+
+		if (coalesce) gpdma_deliver(!busy);
+		if (!busy) sched_yield();
+	}
+	return NULL;
+}
+
+/**
+* Let terminal count interrupts coalesce: the controller latches up to a given
+* number of them before the interrupt is delivered, without waiting for the
+* handler (call before sim_start)
+*
+* @param items		Terminal counts per interrupt, 0 to deliver every one
+*/
+void sim_set_coalesce(int items) {
+	coalesce = (items > 1)? items : 0;
+}
+
+/**
+* Reset the simulated peripherals and start the GPDMA thread
+*
+* @return 0 on success, -1 on failure
+*/
+int sim_start() {
+	memset((void*) &sim_gpdma, 0, sizeof(sim_gpdma));
+	memset((void*) sim_gpdma_channels, 0, sizeof(sim_gpdma_channels));
+	memset((void*) &sim_sc, 0, sizeof(sim_sc));
+	irq_enabled = 0;
+	pending = 0;
+	timer_init();
+
+	running = 1;
+	if (pthread_create(&gpdma_thread, NULL, gpdma_run, NULL)) {
+		running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+* Stop the GPDMA thread
+*/
+void sim_stop() {
+	if (!running) return;
+	pthread_mutex_lock(&irq_lock);
+	running = 0;
+	pthread_cond_broadcast(&irq_unmasked);
+	pthread_mutex_unlock(&irq_lock);
+	pthread_join(gpdma_thread, NULL);
+}
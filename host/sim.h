@@ -0,0 +1,29 @@
+/*
+ * sim.h
+ *
+ * Host simulation of the parts of the LPC1769 the verification pipeline uses:
+ * flash is an mmap'd image file, the GPDMA controller is serviced by a separate
+ * thread that moves data and delivers DMA_IRQHandler, and the cycle counter is
+ * a monotonic nanosecond clock.
+ */
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include "LPC17xx.h"
+
+/* erased flash reads as all ones */
+#define SIM_FLASH_ERASED 0xFF
+
+/* a host "cycle" is a nanosecond of the monotonic clock (SystemCoreClock is set to match) */
+#define SIM_CYCLES_PER_SECOND 1000000000ULL
+
+/* definitions of functions */
+int sim_flash_open(const char* path);
+void sim_flash_close();
+void sim_set_coalesce(int items);
+int sim_start();
+void sim_stop();
+uint64_t sim_nanoseconds();
+
+#endif /* SIM_H_ */
@@ -0,0 +1,336 @@
+/*
+ * sim_iap.c
+ *
+ * Host implementation of the IAP driver on the flash image. Flash addresses
+ * passed in are target addresses (offsets into the image); programming can only
+ * clear bits and needs the sector prepared first, as with the ROM routines.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "iap_driver.h"
+#include "payload_generator.h"
+
+#define SIM_SECTORS 30
+
+/* what the identification commands report: an LPC1769 with boot code 4.1 */
+#define SIM_PART_ID 0x26113F37
+#define SIM_BOOT_CODE_MAJOR 4
+#define SIM_BOOT_CODE_MINOR 1
+
+/* bit n is set while sector n is prepared for the next erase or write */
+static uint32_t prepared_sectors = 0;
+
+/* copy started by iap_copy_ram_to_flash_start, programmed by a thread of its own
+ * so the CPU can prepare the next block meanwhile */
+static pthread_t copy_thread;
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_changed = PTHREAD_COND_INITIALIZER;
+static int copy_started = 0;
+static int copy_busy = 0;
+static int copy_status = CMD_SUCCESS;
+static void* copy_ram;
+static void* copy_flash;
+static e_iap_size copy_count;
+
+/**
+* Get the sector holding a flash offset
+*
+* @param offset		Offset into flash
+*
+* @return the sector number
+*/
+static unsigned int sector_of(uint32_t offset) {
+	if (offset < FLASH_SECTOR_16_ADDRESS) return offset / FLASH_BLOCK_SIZE_4K;
+	return FLASH_SECTOR_16 + (offset - FLASH_SECTOR_16_ADDRESS) / FLASH_BLOCK_SIZE_32K;
+}
+
+/**
+* Get the size of a sector
+*
+* @param sector		Sector number
+*
+* @return the sector size in bytes
+*/
+static uint32_t sector_size(unsigned int sector) {
+	return (sector < FLASH_SECTOR_16)? FLASH_BLOCK_SIZE_4K : FLASH_BLOCK_SIZE_32K;
+}
+
+/**
+* Get a bitmask of a sector range
+*
+* @param sector_start	First sector
+* @param sector_end		Last sector
+*
+* @return bit n set for every sector n in the range
+*/
+static uint32_t sector_mask(unsigned int sector_start, unsigned int sector_end) {
+	return (uint32_t)(((1ULL << (sector_end + 1)) - 1) & ~((1ULL << sector_start) - 1));
+}
+
+/**
+* Init IAP driver
+* @return    0 for success
+*/
+int iap_init(void) {
+	prepared_sectors = 0;
+	return 0;
+}
+
+/**
+* Erase flash sector(s)
+*
+* @param sector_start  The start of the sector to be erased
+* @param sector_end    The end of the sector to be erased
+*
+* @return CMD_SUCCESS, SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION or INVALID_SECTOR
+*/
+int iap_erase_sector(unsigned int sector_start, unsigned int sector_end) {
+	uint32_t mask;
+
+	if (sector_start > sector_end || sector_end >= SIM_SECTORS) return INVALID_SECTOR;
+	mask = sector_mask(sector_start, sector_end);
+	if ((prepared_sectors & mask) != mask) return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+
+	memset(FLASH_ADDRESS(sector_start_address[sector_start]), SIM_FLASH_ERASED,
+			sector_start_address[sector_end] + sector_size(sector_end) - sector_start_address[sector_start]);
+	prepared_sectors &= ~mask;
+	return CMD_SUCCESS;
+}
+
+/**
+* Prepare flash sector(s) for erase / writing
+*
+* @param sector_start  The start of the sector to be prepared
+* @param sector_end    The end of the sector to be prepared
+*
+* @return CMD_SUCCESS or INVALID_SECTOR
+*/
+int iap_prepare_sector(unsigned int sector_start, unsigned int sector_end) {
+	if (sector_start > sector_end || sector_end >= SIM_SECTORS) return INVALID_SECTOR;
+	prepared_sectors |= sector_mask(sector_start, sector_end);
+	return CMD_SUCCESS;
+}
+
+/**
+* Copy RAM contents into flash
+*
+* @param ram_address    RAM address to be copied
+*                       It should be in word boundary
+* @param flash_address  Flash address where the contents are to be copied
+*                       It should be within 256bytes boundary
+* @param count          Number of data to be copied (in bytes)
+*                       The options: 256, 512, 1024, 4096
+*
+* @return CMD_SUCCESS, SRC_ADDR_ERROR, DST_ADDR_ERROR, DST_ADDR_NOT_MAPPED,
+*         COUNT_ERROR or SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION
+*/
+int iap_copy_ram_to_flash(void* ram_address, void* flash_address, e_iap_size count) {
+	uint32_t offset = (uint32_t)(uintptr_t) flash_address;
+	uint8_t* src = (uint8_t*) ram_address;
+	uint8_t* dest;
+	unsigned int sector;
+	uint32_t i;
+
+	if (count != SIZE_256 && count != SIZE_512 && count != SIZE_1024 && count != SIZE_4096)
+		return COUNT_ERROR;
+	if ((uintptr_t) ram_address & 0x03) return SRC_ADDR_ERROR;
+	if (offset & 0xFF) return DST_ADDR_ERROR;
+	if (offset + count > FLASH_SIZE) return DST_ADDR_NOT_MAPPED;
+
+	sector = sector_of(offset);
+	if (!(prepared_sectors & (1UL << sector))) return SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION;
+
+	/* programming only clears bits */
+	dest = FLASH_ADDRESS(offset);
+	for (i=0; i<count; i++)
+		dest[i] &= src[i];
+
+	prepared_sectors &= ~(1UL << sector);
+	return CMD_SUCCESS;
+}
+
+/**
+* Programming thread: program every copy handed over by iap_copy_ram_to_flash_start
+*/
+static void* copy_run(void* arg) {
+	pthread_mutex_lock(&copy_lock);
+	while (1) {
+		while (!copy_busy)
+			pthread_cond_wait(&copy_changed, &copy_lock);
+		pthread_mutex_unlock(&copy_lock);
+
+		copy_status = iap_copy_ram_to_flash(copy_ram, copy_flash, copy_count);
+
+		pthread_mutex_lock(&copy_lock);
+		copy_busy = 0;
+		pthread_cond_broadcast(&copy_changed);
+	}
+	return NULL;
+}
+
+/**
+* Start copying RAM contents into flash on the programming thread, leaving the
+* CPU free until iap_wait
+*
+* @param ram_address    RAM address to be copied
+*                       It should be in word boundary
+* @param flash_address  Flash address where the contents are to be copied
+*                       It should be within 256bytes boundary
+* @param count          Number of data to be copied (in bytes)
+*                       The options: 256, 512, 1024, 4096
+*
+* @return CMD_SUCCESS once started, or BUSY while a copy is in progress
+*/
+int iap_copy_ram_to_flash_start(void* ram_address, void* flash_address, e_iap_size count) {
+	pthread_mutex_lock(&copy_lock);
+	if (copy_busy) {
+		pthread_mutex_unlock(&copy_lock);
+		return BUSY;
+	}
+
+	/* the thread is started with the first copy */
+	if (!copy_started && pthread_create(&copy_thread, NULL, copy_run, NULL)) {
+		pthread_mutex_unlock(&copy_lock);
+		copy_status = iap_copy_ram_to_flash(ram_address, flash_address, count);
+		return CMD_SUCCESS;
+	}
+	copy_started = 1;
+
+	copy_ram = ram_address;
+	copy_flash = flash_address;
+	copy_count = count;
+	copy_busy = 1;
+	pthread_cond_broadcast(&copy_changed);
+	pthread_mutex_unlock(&copy_lock);
+	return CMD_SUCCESS;
+}
+
+/**
+* Wait for the copy started by iap_copy_ram_to_flash_start
+*
+* @return the status of the copy, as iap_copy_ram_to_flash returns it
+*/
+int iap_wait(void) {
+	pthread_mutex_lock(&copy_lock);
+	while (copy_busy)
+		pthread_cond_wait(&copy_changed, &copy_lock);
+	pthread_mutex_unlock(&copy_lock);
+	return copy_status;
+}
+
+/**
+* Compare flash contents with RAM
+*
+* @param flash_address  Flash address of the data to compare
+*                       It should be in word boundary
+* @param ram_address    RAM address of the data to compare
+*                       It should be in word boundary
+* @param count          Number of bytes to compare, a multiple of 4
+* @param offset         Where the offset of the first mismatching word is
+*                       stored on COMPARE_ERROR (may be NULL)
+*
+* @return CMD_SUCCESS, COMPARE_ERROR, COUNT_ERROR, SRC_ADDR_ERROR,
+*         DST_ADDR_ERROR or DST_ADDR_NOT_MAPPED
+*/
+int iap_compare(void* flash_address, void* ram_address, unsigned int count, unsigned int* offset) {
+	uint32_t address = (uint32_t)(uintptr_t) flash_address;
+	uint8_t* flash;
+	uint32_t i;
+
+	if (count & 0x03) return COUNT_ERROR;
+	if ((uintptr_t) ram_address & 0x03) return SRC_ADDR_ERROR;
+	if (address & 0x03) return DST_ADDR_ERROR;
+	if (address + count > FLASH_SIZE) return DST_ADDR_NOT_MAPPED;
+
+	flash = FLASH_ADDRESS(address);
+	for (i=0; i<count; i+=4)
+		if (memcmp(&flash[i], (uint8_t*) ram_address + i, 4)) {
+			if (offset) *offset = i;
+			return COMPARE_ERROR;
+		}
+
+	return CMD_SUCCESS;
+}
+
+/**
+* Blank check flash sector(s)
+*
+* @param sector_start  The start of the sector to be checked
+* @param sector_end    The end of the sector to be checked
+* @param offset        Where the offset of the first non-blank word is stored
+*                      on SECTOR_NOT_BLANK (may be NULL)
+* @param contents      Where that word is stored (may be NULL)
+*
+* @return CMD_SUCCESS, SECTOR_NOT_BLANK or INVALID_SECTOR
+*/
+int iap_blank_check_sector(unsigned int sector_start, unsigned int sector_end,
+		unsigned int* offset, unsigned int* contents) {
+	uint32_t address, end, word;
+
+	if (sector_start > sector_end || sector_end >= SIM_SECTORS) return INVALID_SECTOR;
+	address = sector_start_address[sector_start];
+	end = sector_start_address[sector_end] + sector_size(sector_end);
+
+	for (; address<end; address+=4) {
+		memcpy(&word, FLASH_ADDRESS(address), sizeof(word));
+		if (word != 0xFFFFFFFF) {
+			if (offset) *offset = address;
+			if (contents) *contents = word;
+			return SECTOR_NOT_BLANK;
+		}
+	}
+
+	return CMD_SUCCESS;
+}
+
+/**
+* Read the part identification number
+*
+* @param part_id       Where the part ID is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_part_id(unsigned int* part_id) {
+	*part_id = SIM_PART_ID;
+	return CMD_SUCCESS;
+}
+
+/**
+* Read the boot code version number
+*
+* @param major         Where the major version is stored
+* @param minor         Where the minor version is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_boot_code_version(unsigned char* major, unsigned char* minor) {
+	*major = SIM_BOOT_CODE_MAJOR;
+	*minor = SIM_BOOT_CODE_MINOR;
+	return CMD_SUCCESS;
+}
+
+/**
+* Read the device serial number (a fixed one on the host)
+*
+* @param uid           Where the four words of the serial number are stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_uid(unsigned int uid[4]) {
+	uid[0] = SIM_PART_ID;
+	uid[1] = (unsigned int) FLASH_SIZE;
+	uid[2] = 0;
+	uid[3] = 1;
+	return CMD_SUCCESS;
+}
+
+/**
+* Invoke the ISP bootloader; the host has none, so the process ends
+*/
+void iap_reinvoke_isp(void) {
+	fprintf(stderr, "ISP reinvoked\n");
+	exit(0);
+}
@@ -0,0 +1,81 @@
+/*
+ * stream_verify.c
+ *
+ * Verify an archive piped in on stdin with archive_stream, the way the board
+ * verifies a package arriving over UART or SPI: it is fed in chunks as they are
+ * read and never written anywhere. Exits non-zero when the archive does not
+ * verify.
+ *
+ *   stream_verify -f < flash.bin
+ *   tail -c +16385 flash.bin | stream_verify -c 100
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "definitions.h"
+#include "archive_stream.h"
+#include "digest.h"
+
+#define DEFAULT_CHUNK 4096
+#define MAX_CHUNK 65536
+
+/**
+* main function
+*/
+int main(int argc, char* argv[]) {
+	static uint8_t chunk[MAX_CHUNK];
+	archive_stream stream;
+	uint32_t chunk_size = DEFAULT_CHUNK, skip = 0, bytes = 0;
+	uint64_t start, nanoseconds;
+	ssize_t length;
+	int scan_all = 0, valid, algorithm, opt;
+
+	while ((opt = getopt(argc, argv, "ac:fH:")) != -1)
+		switch (opt) {
+		case 'a': scan_all = 1; break;
+		case 'c': chunk_size = atoi(optarg); break;
+		case 'f': skip = HEADER_OFFSET; break;
+		case 'H':
+			for (algorithm=0; algorithm<DIGEST_ALGORITHMS; algorithm++)
+				if (!strcmp(optarg, digest_backend_of(algorithm)->name)) break;
+			if (algorithm == DIGEST_ALGORITHMS) {
+				fprintf(stderr, "%s: unknown digest %s\n", argv[0], optarg);
+				return 2;
+			}
+			verify_set_required_digest(algorithm);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-a] [-c bytes] [-f] [-H digest] < archive\n"
+					"  -a  map every bad part instead of stopping at the first\n"
+					"  -c  bytes read and fed per chunk (default %d)\n"
+					"  -f  stdin is a whole flash image, not the archive from the header on\n"
+					"  -H  digest the archive must be hashed with: md5 (default), crc32 or sha256\n",
+					argv[0], DEFAULT_CHUNK);
+			return 2;
+		}
+	if (chunk_size < 1 || chunk_size > MAX_CHUNK) chunk_size = DEFAULT_CHUNK;
+
+	/* drop the flash in front of the header */
+	while (skip && (length = read(STDIN_FILENO, chunk, (skip < chunk_size)? skip : chunk_size)) > 0)
+		skip -= length;
+
+	archive_stream_begin(&stream, scan_all);
+	start = sim_nanoseconds();
+	while ((length = read(STDIN_FILENO, chunk, chunk_size)) > 0) {
+		bytes += length;
+		if (!archive_stream_feed(&stream, chunk, length) && !scan_all) break;
+	}
+	valid = archive_stream_end(&stream);
+	nanoseconds = sim_nanoseconds() - start;
+
+	printf("%u parts of %u bytes, %u B streamed in %u B chunks  %.3f ms  %s\n",
+			stream.no_parts, (unsigned) stream.part_size, (unsigned) bytes, (unsigned) chunk_size,
+			(double) nanoseconds / 1e6, verify_status_name(stream.result.status));
+	if (stream.result.bad_parts)
+		printf("%u bad parts, the first is part %u\n", stream.result.bad_parts, stream.result.first_bad_part);
+
+	return (valid)? 0 : 1;
+}
@@ -0,0 +1,267 @@
+/*
+ * verify_bench.c
+ *
+ * Host throughput benchmark of the verification pipeline on a flash image:
+ * write_payload, calculate_part_hash, every digest backend and verify with every
+ * DMA policy and with the flash engine. Exits non-zero when the archive does not
+ * verify, so it can gate changes in CI.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "iap_driver.h"
+#include "payload_generator.h"
+#include "definitions.h"
+#include "benchmark.h"
+#include "merkle.h"
+#include "digest.h"
+
+#define DEFAULT_IMAGE "flash.bin"
+#define DEFAULT_ROUNDS 10
+
+/**
+* Print the throughput of a benchmarked function
+*
+* @param name			Function benchmarked
+* @param bytes			Bytes processed per round
+* @param rounds			Number of rounds
+* @param nanoseconds	Time taken by all rounds
+* @param valid			Outcome to report, or -1 for none
+*/
+static void report(const char* name, uint32_t bytes, int rounds, uint64_t nanoseconds, int valid) {
+	double seconds = (double) nanoseconds / SIM_CYCLES_PER_SECOND;
+
+	printf("%-28s %8u B x %3d  %10.3f ms/round  %9.2f MB/s",
+			name, bytes, rounds, seconds * 1000 / rounds,
+			(seconds > 0)? (double) bytes * rounds / seconds / 1e6 : 0.0);
+	if (valid >= 0) printf("  %s", (valid)? "valid" : "INVALID");
+	printf("\n");
+}
+
+/**
+* Show the progress of write_payload
+*
+* @param written	Payload bytes programmed so far
+* @param total		Payload bytes in all
+*/
+static void show_progress(uint32_t written, uint32_t total) {
+	fprintf(stderr, "\rprogramming %3u%%", (unsigned) ((uint64_t)written * 100 / total));
+	if (written == total) fprintf(stderr, "\n");
+}
+
+/**
+* Time write_payload, erasing the payload sectors before every round
+*
+* @param rounds		Number of rounds
+*
+* @return IAP status codes
+*/
+static int bench_write_payload(int rounds) {
+	uint64_t total = 0, start;
+	int round, iap_status = CMD_SUCCESS;
+
+	for (round=0; round<rounds; round++) {
+		iap_prepare_sector(FLASH_USER_PAYLOAD_START_SECTOR, FLASH_USER_PAYLOAD_END_SECTOR);
+		iap_erase_sector(FLASH_USER_PAYLOAD_START_SECTOR, FLASH_USER_PAYLOAD_END_SECTOR);
+
+		start = sim_nanoseconds();
+		iap_status = write_payload();
+		total += sim_nanoseconds() - start;
+		if (iap_status != CMD_SUCCESS) return iap_status;
+	}
+
+	report("write_payload", sector_start_address[FLASH_USER_END_SECTOR] -
+			sector_start_address[FLASH_USER_PAYLOAD_START_SECTOR], rounds, total, -1);
+	return iap_status;
+}
+
+/**
+* Time calculate_part_hash over every part of the archive in flash
+*
+* @param rounds		Number of rounds
+*/
+static void bench_part_hash(int rounds) {
+	uint8_t digest[HASH_SIZE];
+	uint32_t part_size = get_part_size();
+	uint16_t no_parts = get_number_of_parts(), i;
+	uint64_t start;
+	int round;
+
+	start = sim_nanoseconds();
+	for (round=0; round<rounds; round++)
+		for (i=0; i<no_parts; i++)
+			calculate_part_hash(PART_STARTING_ADDRESS + (uint32_t)i * part_size, part_size - HASH_SIZE, digest);
+	report("calculate_part_hash", (part_size - HASH_SIZE) * no_parts, rounds, sim_nanoseconds() - start, -1);
+}
+
+/**
+* Time verify with a given engine and DMA policy
+*
+* @param name		Label of the configuration
+* @param engine		Engine verify uses
+* @param policy		DMA policy of the DMA engine
+* @param rounds		Number of rounds
+*
+* @return archive is valid in every round or is not valid
+*/
+static int bench_verify(const char* name, e_verify_engine engine, e_dma_policy policy, int rounds) {
+	uint64_t start;
+	int round, valid = 1;
+
+	verify_set_engine(engine);
+	DMA_set_policy(policy);
+
+	start = sim_nanoseconds();
+	for (round=0; round<rounds; round++)
+		valid &= verify();
+	report(name, (uint32_t)get_number_of_parts() * get_part_size(), rounds, sim_nanoseconds() - start, valid);
+	return valid;
+}
+
+/**
+* Time archive_verify_part over every part of a Merkle archive
+*
+* @param rounds		Number of rounds
+*
+* @return every part is valid in every round or is not valid
+*/
+static int bench_verify_parts(int rounds) {
+	verify_result result;
+	uint16_t no_parts = get_number_of_parts(), i;
+	uint64_t start;
+	int round, valid = 1;
+
+	start = sim_nanoseconds();
+	for (round=0; round<rounds; round++)
+		for (i=0; i<no_parts; i++)
+			valid &= archive_verify_part(i, &result);
+	report("archive_verify_part", (uint32_t)no_parts * get_part_size(), rounds, sim_nanoseconds() - start, valid);
+	return valid;
+}
+
+/**
+* main function
+*/
+int main(int argc, char* argv[]) {
+	const char* image = DEFAULT_IMAGE;
+	int rounds = DEFAULT_ROUNDS, generate = 0, autotune = 0, verify_only = 0, table = 0, checkpoint = 0, cache = 0, merkle = 0, install = 0, delta = 0, progress = 0, legacy = 0, valid = 1, opt;
+	int algorithm = -1;
+	uint64_t start;
+
+	while ((opt = getopt(argc, argv, "ac:dgH:iI:kmn:prtTv")) != -1)
+		switch (opt) {
+		case 'a': autotune = 1; break;
+		case 'c': checkpoint = atoi(optarg); break;
+		case 'd': delta = 1; generate = 1; break;
+		case 'g': generate = 1; break;
+		case 'H':
+			for (algorithm=0; algorithm<DIGEST_ALGORITHMS; algorithm++)
+				if (!strcmp(optarg, digest_backend_of(algorithm)->name)) break;
+			if (algorithm == DIGEST_ALGORITHMS) {
+				fprintf(stderr, "%s: unknown digest %s\n", argv[0], optarg);
+				return 2;
+			}
+			generate = 1;
+			break;
+		case 'i': install = 1; generate = 1; break;
+		case 'I': sim_set_coalesce(atoi(optarg)); break;
+		case 'k': cache = 1; break;
+		case 'm': merkle = 1; generate = 1; break;
+		case 'n': rounds = atoi(optarg); break;
+		case 'p': progress = 1; break;
+		case 'r': legacy = 1; break;
+		case 't': table = 1; break;
+		case 'T': table = 2; break;
+		case 'v': verify_only = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-g] [-d] [-H digest] [-i] [-I items] [-a] [-c parts] [-k] [-m] [-n rounds] [-p] [-r] [-t|-T] [-v] [image]\n"
+					"  -g  generate the archive even if the image holds one\n"
+					"  -d  update the archive in the image, re-flashing only changed sectors\n"
+					"  -H  generate the archive with a digest: md5 (default), crc32 or sha256\n"
+					"  -i  generate in install mode, reading back every block as it is programmed\n"
+					"  -I  let up to so many DMA terminal counts coalesce into one interrupt\n"
+					"  -a  autotune the DMA control template first (once, it is kept in the log sector)\n"
+					"  -c  persist a verification checkpoint every so many parts\n"
+					"  -k  use the verified-archive cache (warm boots skip the payload)\n"
+					"  -m  generate a Merkle archive and time per-part verification\n"
+					"  -n  rounds per measurement (default %d)\n"
+					"  -p  show the progress of generating the payload\n"
+					"  -r  seed the payload with newlib's rand, as older builds did\n"
+					"  -t  print the benchmark table of this build (-T without its header)\n"
+					"  -v  only verify, leaving the image as it is\n", argv[0], DEFAULT_ROUNDS);
+			return 2;
+		}
+	if (optind < argc) image = argv[optind];
+	if (rounds < 1) rounds = 1;
+
+	if (sim_flash_open(image) || sim_start()) return 2;
+	if (table) generate = 1;
+	generator_set_merkle(merkle);
+	generator_set_install(install);
+	generator_set_delta(delta);
+	generator_set_prng((legacy)? PAYLOAD_PRNG_NEWLIB : PAYLOAD_PRNG_DEFAULT);
+	if (progress) generator_set_progress(show_progress);
+
+	/* an archive kept in the image is rewritten with its own digest */
+	if (algorithm < 0)
+		algorithm = (!generate && get_preamble() == VALID_PREAMBLE)? get_digest_algorithm() : DIGEST_MD5;
+	generator_set_digest(algorithm);
+	digest_select(algorithm);
+	verify_set_required_digest(algorithm);
+
+	/* generate the archive into a new or forced image */
+	if (generate || get_preamble() != VALID_PREAMBLE) {
+		start = sim_nanoseconds();
+		if (generator_init() != CMD_SUCCESS) {
+			if (generator_get_fault() != GENERATOR_NO_FAULT)
+				fprintf(stderr, "generator_init failed at flash offset 0x%05x\n", generator_get_fault());
+			else
+				fprintf(stderr, "generator_init failed\n");
+			return 2;
+		}
+		if (delta && !table)
+			printf("%u payload sectors re-flashed\n", generator_sectors_written());
+		if (!table)
+			report((install)? "generator_init (install)" : "generator_init", sector_start_address[FLASH_USER_END_SECTOR] + FLASH_BLOCK_SIZE_4K -
+					sector_start_address[FLASH_USER_HEADER_SECTOR], 1, sim_nanoseconds() - start, -1);
+	}
+
+	/* the same table the board prints with VERIFY_BENCHMARK */
+	if (table) {
+		valid = benchmark_table(table == 1);
+		sim_stop();
+		sim_flash_close();
+		return (valid)? 0 : 1;
+	}
+
+	printf("%s: %u parts of %u bytes (%s)\n", image, get_number_of_parts(), get_part_size(),
+			(digest_backend_of(get_digest_algorithm()))? digest_backend_of(get_digest_algorithm())->name : "unknown digest");
+
+	/* rewriting the payload would repair a corrupted image */
+	if (!verify_only) {
+		if (bench_write_payload(rounds) != CMD_SUCCESS) {
+			fprintf(stderr, "write_payload failed\n");
+			return 2;
+		}
+		bench_part_hash(rounds);
+		benchmark_digests(rounds);
+	}
+
+	if (autotune) printf("DMA control template 0x%08x\n", DMA_autotune());
+	verify_set_checkpoint_interval(checkpoint);
+	verify_set_cache(cache);
+
+	valid &= bench_verify("verify (dma, single)", VERIFY_ENGINE_DMA, DMA_POLICY_SINGLE, rounds);
+	valid &= bench_verify("verify (dma, linked)", VERIFY_ENGINE_DMA, DMA_POLICY_LINKED, rounds);
+	valid &= bench_verify("verify (dma, striped)", VERIFY_ENGINE_DMA, DMA_POLICY_STRIPED, rounds);
+	valid &= bench_verify("verify (flash)", VERIFY_ENGINE_FLASH, DMA_DEFAULT_POLICY, rounds);
+	if (archive_is_merkle())
+		valid &= bench_verify_parts(rounds);
+
+	sim_stop();
+	sim_flash_close();
+	return (valid)? 0 : 1;
+}
@@ -0,0 +1,84 @@
+/*
+ * verify_images.c
+ *
+ * Audit archive images (flash dumps or build_archive output) on every core.
+ * Prints a line per image and exits non-zero when any image does not verify.
+ *
+ *   verify_images -a dump1.bin dump2.bin
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image_verify.h"
+
+/**
+* main function
+*/
+int main(int argc, char* argv[]) {
+	archive_image image;
+	verify_result result;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), scan_all = 0, invalid = 0, algorithm, opt, i;
+	unsigned int lanes = MD5_x_N_select(MD5_MAX_LANES);
+	uint64_t start, nanoseconds, bytes, total_nanoseconds = 0, total_bytes = 0;
+
+	while ((opt = getopt(argc, argv, "aH:j:l:")) != -1)
+		switch (opt) {
+		case 'a': scan_all = 1; break;
+		case 'H':
+			for (algorithm=0; algorithm<DIGEST_ALGORITHMS; algorithm++)
+				if (!strcmp(optarg, digest_backend_of(algorithm)->name)) break;
+			if (algorithm == DIGEST_ALGORITHMS) {
+				fprintf(stderr, "%s: unknown digest %s\n", argv[0], optarg);
+				return 2;
+			}
+			verify_set_required_digest(algorithm);
+			break;
+		case 'j': threads = atoi(optarg); break;
+		case 'l': lanes = MD5_x_N_select(atoi(optarg)); break;
+		default:
+			fprintf(stderr, "usage: %s [-a] [-H digest] [-j threads] [-l lanes] image...\n"
+					"  -a  map every bad part instead of stopping at the first\n"
+					"  -H  digest the images must be hashed with: md5 (default), crc32 or sha256\n"
+					"  -j  hashing threads (default: one per core)\n"
+					"  -l  MD5 lanes at most (1, 4, 8 or 16, default: the widest the CPU has)\n", argv[0]);
+			return 2;
+		}
+	if (optind == argc) {
+		fprintf(stderr, "%s: no images given\n", argv[0]);
+		return 2;
+	}
+
+	for (i=optind; i<argc; i++) {
+		if (image_open(&image, argv[i])) {
+			invalid++;
+			continue;
+		}
+
+		verify_result_init(&result, scan_all);
+		start = sim_nanoseconds();
+		if (!image_verify(&image, threads, &result)) invalid++;
+		nanoseconds = sim_nanoseconds() - start;
+		/* only a full scan hashes every part */
+		bytes = (result.status == VERIFY_OK || (result.status == VERIFY_BAD_PART && scan_all))?
+				(uint64_t)get_number_of_parts() * get_part_size() : 0;
+		total_nanoseconds += nanoseconds;
+		total_bytes += bytes;
+
+		printf("%-32s %5u parts of %5u B  %8.3f ms  %8.2f MB/s  %s", argv[i],
+				(result.status == VERIFY_OK || result.status == VERIFY_BAD_PART)? get_number_of_parts() : 0,
+				(unsigned) ((result.status == VERIFY_OK || result.status == VERIFY_BAD_PART)? get_part_size() : 0),
+				(double) nanoseconds / 1e6, (nanoseconds)? (double) bytes * 1e3 / nanoseconds : 0.0,
+				verify_status_name(result.status));
+		if (result.bad_parts)
+			printf(" (%u, the first is part %u)", result.bad_parts, result.first_bad_part);
+		printf("\n");
+		image_close(&image);
+	}
+
+	if (argc - optind > 1)
+		printf("%d images, %d invalid, %.2f MB/s (%u MD5 lanes)\n", argc - optind, invalid,
+				(total_nanoseconds)? (double) total_bytes * 1e3 / total_nanoseconds : 0.0, lanes);
+	return (invalid)? 1 : 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * archive_stream.h
+ */
+
+#ifndef ARCHIVE_STREAM_H_
+#define ARCHIVE_STREAM_H_
+
+#include "digest.h"
+
+/* a streamed archive is laid out as it is in flash from HEADER_OFFSET on: the
+ * header block, the parts and the footer (anything after the footer is ignored) */
+#define ARCHIVE_STREAM_HEADER_SIZE (PART_STARTING_OFFSET - HEADER_OFFSET)
+#define ARCHIVE_STREAM_FIELDS_SIZE (ARCHIVE_DIGEST_OFFSET + 1)
+#define ARCHIVE_STREAM_FOOTER_SIZE 8
+
+/* what the next streamed byte belongs to */
+typedef enum {
+	STREAM_HEADER = 0,
+	STREAM_PARTS,
+	STREAM_FOOTER,
+	STREAM_DONE,			/* footer seen or the archive found invalid */
+} e_stream_phase;
+
+/* state of a streamed verification, carried from one chunk to the next */
+typedef struct {
+	e_stream_phase phase;
+	uint32_t offset;								/* bytes taken by the current phase or part */
+	uint8_t fields[ARCHIVE_STREAM_FIELDS_SIZE];		/* preamble, part count, part size, flags and digest */
+	uint8_t footer[ARCHIVE_STREAM_FOOTER_SIZE];
+	uint16_t no_parts;
+	uint32_t part_size;
+	uint16_t part;									/* part being received */
+	uint8_t expected[HASH_SIZE];					/* hash stored with that part */
+	const digest_backend* digest;					/* digest named in the header */
+	digest_ctx context;								/* hash of its data received so far */
+	verify_result result;
+} archive_stream;
+
+/* definitions of functions */
+void archive_stream_begin(archive_stream* stream, uint8_t scan_all);
+uint8_t archive_stream_feed(archive_stream* stream, const uint8_t* data, uint32_t length);
+uint8_t archive_stream_end(archive_stream* stream);
+
+#endif /* ARCHIVE_STREAM_H_ */
@@ -0,0 +1,31 @@
+/*
+ * benchmark.h
+ */
+
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+/* verify runs averaged into a table row */
+#define BENCHMARK_ROUNDS 8
+
+/* throughput of verify on the archive in flash */
+typedef struct {
+	uint8_t valid;					/* every round verified the archive */
+	uint32_t part_size;
+	uint16_t parts;
+	uint32_t block_size;			/* RAM_BLOCK_SIZE of this build */
+	uint64_t cycles;				/* cycles of all rounds */
+	uint64_t idle_cycles;			/* cycles the DMA sat idle with blocks left to move */
+	uint32_t bytes_per_second;
+	uint32_t cycles_per_part;
+	uint32_t dma_idle_x10;			/* DMA idle percentage, in tenths */
+} benchmark_row;
+
+/* definitions of functions */
+uint8_t benchmark_run(benchmark_row* row, uint8_t rounds);
+void benchmark_print_header();
+void benchmark_print_row(const benchmark_row* row);
+uint8_t benchmark_table(uint8_t print_header);
+void benchmark_digests(uint8_t rounds);
+
+#endif /* BENCHMARK_H_ */
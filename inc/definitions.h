@@ -7,7 +7,6 @@
 
 #ifndef DEFINITIONS_H_
 #define DEFINITIONS_H_
-#endif /* DEFINITIONS_H_ */
 
 /* definitions of frequently used variables */
 #define HASH_SIZE 16
@@ -17,26 +16,181 @@
 #define HALFWORD_WIDTH 0x01
 #define WORD_WIDTH 0x02
 #define TRANSFER_WIDTH WORD_WIDTH
-#define HEADER_ADDRESS 0x4000
-#define RAM_BLOCK_SIZE (2048* ((1 << TRANSFER_WIDTH) | TRANSFER_WIDTH))
-#define TRANSFER_SIZE (RAM_BLOCK_SIZE >> TRANSFER_WIDTH)
-#define PART_STARTING_ADDRESS 0x5000
+#define HEADER_OFFSET 0x4000
+#define PART_STARTING_OFFSET 0x5000
+#define HEADER_ADDRESS FLASH_ADDRESS(HEADER_OFFSET)
+#define PART_STARTING_ADDRESS FLASH_ADDRESS(PART_STARTING_OFFSET)
+#define PAYLOAD_REGION_SIZE (0x78000 - PART_STARTING_OFFSET)
+
+/* number of RAM blocks in the verification ring (DMA runs up to
+ * DMA_RING_DEPTH - 1 blocks ahead of hashing), alternating between AHB SRAM banks */
+#define DMA_RING_DEPTH 4
+#if DMA_RING_DEPTH < 2 || DMA_RING_DEPTH > 8 || (DMA_RING_DEPTH & (DMA_RING_DEPTH - 1))
+#error "DMA_RING_DEPTH must be a power of two between 2 and the 8 GPDMA channels"
+#endif
+
+/* the ring takes both 16 KB AHB SRAM banks (RAM2), away from the CPU's local SRAM */
+#define AHB_SRAM_BANK_SIZE (16 * 1024)
+#define DMA_RING_BUDGET (2 * AHB_SRAM_BANK_SIZE)
+
+/* a single channel transfer is limited to 4095 items, keep blocks a power of two
+ * below what word transfers can move; narrower widths are only usable on blocks
+ * that stay within the limit (see DMA_width_fits). Benchmark builds may pass a
+ * smaller RAM_BLOCK_SIZE. */
+#define DMA_MAX_ITEMS 4095
+#define DMA_MAX_BLOCK_SIZE (2048 << WORD_WIDTH)
+#ifndef RAM_BLOCK_SIZE
+#define RAM_BLOCK_SIZE (((DMA_RING_BUDGET / DMA_RING_DEPTH) < DMA_MAX_BLOCK_SIZE)? \
+		(DMA_RING_BUDGET / DMA_RING_DEPTH) : DMA_MAX_BLOCK_SIZE)
+#endif
+#if RAM_BLOCK_SIZE * DMA_RING_DEPTH > DMA_RING_BUDGET || RAM_BLOCK_SIZE > DMA_MAX_BLOCK_SIZE
+#error "RAM_BLOCK_SIZE does not fit DMA_RING_DEPTH blocks in the AHB SRAM banks"
+#endif
+#if (RAM_BLOCK_SIZE >> TRANSFER_WIDTH) > DMA_MAX_ITEMS
+#error "TRANSFER_WIDTH is too narrow for RAM_BLOCK_SIZE, deepen the ring or widen the transfers"
+#endif
+
+/* channel control template: burst sizes (0..7 for 1, 4, 8, 16, 32, 64, 128, 256
+ * items), source/destination width, incrementing addresses and terminal count
+ * interrupt; the transfer size is OR-ed into bits 0..11 per transfer */
+#define DMA_CONTROL(sb_size, db_size, width) (((sb_size) << 12) | ((db_size) << 15) | \
+		((width) << 18) | ((width) << 21) | (1 << 26) | (1 << 27) | (1UL << 31))
+#define DMA_CONTROL_WIDTH(control) (((control) >> 18) & 0x07)
+#define DMA_DEFAULT_CONTROL DMA_CONTROL(0, 0, TRANSFER_WIDTH)
+
+/* body of the loops waiting on the DMA controller (a host build with a simulated
+ * controller yields to it here) */
+#ifndef CPU_RELAX
+#define CPU_RELAX()
+#endif
+
+/* number of timed transfers per combination while autotuning */
+#define DMA_AUTOTUNE_ROUNDS 4
+
+/* how verify moves the payload into the ring */
+typedef enum {
+	DMA_POLICY_SINGLE = 0,	/* channel 0, a one-shot transfer re-armed per block */
+	DMA_POLICY_LINKED,		/* channel 0, a linked list chain over every free block */
+	DMA_POLICY_STRIPED,		/* block i on channel (i % DMA_RING_DEPTH), several in flight */
+} e_dma_policy;
+
+#define DMA_DEFAULT_POLICY DMA_POLICY_LINKED
 
-/* definition of global variable */
-extern volatile uint8_t transfer_finished;
+/* upper bound of linked list items needed to describe the whole payload region
+ * (a block always holds at least half of RAM_BLOCK_SIZE worth of whole parts) */
+#define DMA_MAX_LLI ((PAYLOAD_REGION_SIZE / (RAM_BLOCK_SIZE / 2)) + 1)
+
+/* GPDMA linked list item, laid out exactly as the controller fetches it */
+typedef struct {
+	uintptr_t src_addr;
+	uintptr_t dest_addr;
+	uintptr_t next_lli;
+	uint32_t control;
+} DMA_LLI;
+
+/* outcome of a verification */
+typedef enum {
+	VERIFY_OK = 0,
+	VERIFY_BAD_LAYOUT,		/* part size or part count cannot be verified */
+	VERIFY_BAD_PREAMBLE,
+	VERIFY_BAD_FOOTER,
+	VERIFY_DMA_ERROR,
+	VERIFY_BAD_PART,		/* at least one stored hash does not match its part */
+	VERIFY_BAD_TREE,		/* a Merkle node or the root does not match the parts below it */
+	VERIFY_TRUNCATED,		/* a streamed archive ended before its footer */
+} e_verify_status;
+
+/* parts tracked by the bad part map (later parts are only counted) */
+#define VERIFY_MAP_PARTS 2048
+
+/* where an archive is corrupted */
+typedef struct {
+	e_verify_status status;
+	uint8_t scan_all;						/* continue past mismatching parts */
+	uint16_t first_bad_part;
+	uint8_t* first_bad_address;				/* flash address of the first bad part */
+	uint8_t expected[HASH_SIZE];			/* hash stored with the first bad part */
+	uint8_t computed[HASH_SIZE];			/* hash calculated over its data */
+	uint16_t bad_parts;
+	uint8_t bad_part_map[VERIFY_MAP_PARTS / 8];	/* bit n is set if part n is bad */
+	uint16_t resumed_part;					/* parts trusted from a checkpoint, not re-read */
+	uint8_t cached;							/* valid from the verified-archive cache, payload not re-read */
+} verify_result;
+
+/* which engine verify uses */
+typedef enum {
+	VERIFY_ENGINE_DMA = 0,	/* stream the payload through the DMA ring and hash it in RAM */
+	VERIFY_ENGINE_FLASH,	/* hash parts in place through the flash accelerator */
+	VERIFY_ENGINE_AUTO,		/* flash engine for parts up to VERIFY_FLASH_MAX_PART_SIZE */
+} e_verify_engine;
+
+#define VERIFY_DEFAULT_ENGINE VERIFY_ENGINE_DMA
+#define VERIFY_FLASH_MAX_PART_SIZE (PAYLOAD_TINY_SIZE + HASH_SIZE)
+
+/* result of running both engines over the same archive */
+typedef struct {
+	uint8_t dma_valid;
+	uint8_t flash_valid;
+	uint32_t bytes;						/* payload bytes hashed by each engine */
+	uint32_t dma_cycles;
+	uint32_t flash_cycles;
+	uint32_t dma_cycles_per_byte_x100;	/* cycles per byte, in hundredths */
+	uint32_t flash_cycles_per_byte_x100;
+} verify_benchmark_result;
+
+/* definition of global variable (bit n is set once channel n reaches terminal count) */
+extern volatile uint8_t channels_finished;
 
 /* definitions of functions */
+uint16_t get_two_bytes(uint8_t* location);
+uint32_t get_four_bytes(uint8_t* location);
 uint16_t get_preamble();
 uint16_t get_number_of_parts();
 uint32_t get_part_size();
+uint8_t get_digest_algorithm();
 uint64_t get_eight_bytes(uint8_t* location);
 uint64_t get_footer(uint32_t part_size, uint16_t no_of_parts);
-void calculate_part_hash(uint8_t* part, uint32_t part_size);
+uint8_t archive_fits(uint32_t part_size, uint16_t no_of_parts, uint32_t tail_size);
+void calculate_part_hash(const uint8_t* part, uint32_t part_size, uint8_t* digest);
+uint8_t record_bad_part(verify_result* result, uint16_t part, const uint8_t* stored,
+		const uint8_t* digest, uint32_t part_size);
+uint8_t check_header(verify_result* result, uint32_t part_size, uint16_t no_parts);
 void DMA_init();
+uint32_t DMA_control_word(uint16_t transfer_size);
+uint8_t DMA_width_fits(uint8_t width);
+void DMA_set_control_template(uint32_t control);
+uint32_t DMA_get_control_template();
+uint32_t DMA_autotune();
 void DMA_transfer(uint8_t* src_addr, uint8_t* dest_addr, uint16_t transfer_size);
-void transfer_to_RAM(uint8_t* src_addr, uint8_t* dest_addr, uint16_t* no_parts,
-		uint16_t* block_capacity, uint32_t* part_size);
+void DMA_set_policy(e_dma_policy policy);
+e_dma_policy DMA_get_policy();
+void DMA_stop();
+void DMA_start_item(LPC_GPDMACH_TypeDef* channel, DMA_LLI* item);
+uint16_t DMA_build_chain(uint8_t* src_addr, uint16_t no_blocks,
+		uint32_t block_bytes, uint32_t last_block_bytes);
+void DMA_refill_ring();
 uint8_t verify_block(uint8_t* block_addr, uint16_t* block_capacity,
-		uint16_t* parts_to_verify, uint32_t* part_size);
+		uint16_t* parts_to_verify, uint32_t* part_size, uint16_t first_part,
+		verify_result* result);
+uint8_t verify_ring(verify_result* result);
+uint8_t verify_flash(verify_result* result);
+uint16_t checkpoint_begin(verify_result* result, uint16_t no_parts, uint32_t part_size);
+uint8_t checkpoint_due(verify_result* result, uint16_t next_part);
+void checkpoint_write(uint16_t next_part);
+void checkpoint_finish(verify_result* result, uint16_t no_parts);
+void ring_checkpoint(uint16_t next_part);
+void verify_set_cache(uint8_t enabled);
+void verify_set_required_digest(uint8_t algorithm);
+uint8_t verify_get_required_digest();
+uint8_t verify_cached(verify_result* result);
+void verify_set_checkpoint_interval(uint16_t parts);
+uint16_t verify_get_checkpoint_interval();
+void verify_set_engine(e_verify_engine engine);
+e_verify_engine verify_get_engine();
+void verify_benchmark(verify_benchmark_result* result);
+void verify_result_init(verify_result* result, uint8_t scan_all);
+const char* verify_status_name(e_verify_status status);
+uint8_t verify_report(verify_result* result, uint8_t scan_all);
 uint8_t verify();
 
+#endif /* DEFINITIONS_H_ */
@@ -0,0 +1,58 @@
+/*
+ * digest.h
+ */
+
+#ifndef DIGEST_H_
+#define DIGEST_H_
+
+#include "md5.h"
+
+/* header byte naming the digest of the part hashes and Merkle nodes (zero, MD5,
+ * in archives written before the field existed) */
+#define ARCHIVE_DIGEST_OFFSET 10
+
+/* digests an archive can be hashed with. Every digest fills the 16-byte hash slot
+ * in front of a part: a shorter one is followed by zeros, a longer one truncated. */
+typedef enum {
+	DIGEST_MD5 = 0,			/* the original format */
+	DIGEST_CRC32,			/* corruption detection only, the cheapest on the board */
+	DIGEST_SHA256,			/* SHA-256 truncated to 128 bits */
+	DIGEST_ALGORITHMS
+} e_digest_algorithm;
+
+/* state of a SHA-256 digest */
+typedef struct {
+	uint32_t state[8];
+	uint32_t length;				/* bytes hashed so far */
+	uint8_t buffer[64];				/* bytes of an incomplete block */
+} sha256_ctx;
+
+/* state of a digest computed over data arriving in pieces */
+typedef union {
+	MD5_CTX md5;
+	uint32_t crc32;
+	sha256_ctx sha256;
+} digest_ctx;
+
+/* a digest backend. digest is the one-shot form of init, update and final;
+ * batch, when set, hashes messages of equal size side by side. Every form
+ * writes the full 16-byte slot. */
+typedef struct {
+	const char* name;
+	uint8_t size;					/* bytes of the slot the digest fills */
+	void (*init)(digest_ctx* ctx);
+	void (*update)(digest_ctx* ctx, const void* data, uint32_t size);
+	void (*final)(digest_ctx* ctx, uint8_t* digest);
+	void (*digest)(const void* data, uint32_t size, uint8_t* digest);
+	void (*batch)(const void* const* data, uint32_t size, uint8_t* const* digests, uint32_t count);
+} digest_backend;
+
+/* definitions of functions */
+const digest_backend* digest_backend_of(uint8_t algorithm);
+void digest_select(e_digest_algorithm algorithm);
+e_digest_algorithm digest_selected_algorithm();
+const digest_backend* digest_selected();
+void digest_batch(const digest_backend* backend, const void* const* data, uint32_t size,
+		uint8_t* const* digests, uint32_t count);
+
+#endif /* DIGEST_H_ */
@@ -105,4 +105,93 @@ int iap_prepare_sector(unsigned int sector_start, unsigned int sector_end);
 */
 int iap_copy_ram_to_flash(void* ram_address, void* flash_address, e_iap_size count);
 
+/**
+* Copy RAM contents into flash, to be finished with iap_wait. The ROM routine
+* holds the core until the write is done, so on the board the copy is complete
+* when the call returns and iap_wait only returns the stored status; the CPU
+* only works on while flash is programmed in the host simulation.
+* The sector must be prepared and the RAM must not change until iap_wait returns.
+*
+* @param ram_address    RAM address to be copied
+*                       It should be in word boundary
+* @param flash_address  Flash address where the contents are to be copied
+*                       It should be within 256bytes boundary
+* @param count          Number of data to be copied (in bytes)
+*                       The options: 256, 512, 1024, 4096
+*
+* @return CMD_SUCCESS (the host simulation returns BUSY while a copy is in progress)
+*/
+int iap_copy_ram_to_flash_start(void* ram_address, void* flash_address, e_iap_size count);
+
+/**
+* Wait for the copy started by iap_copy_ram_to_flash_start (on the board it is
+* already done)
+*
+* @return the status of the copy, as iap_copy_ram_to_flash returns it
+*/
+int iap_wait(void);
+
+/**
+* Compare flash contents with RAM
+*
+* @param flash_address  Flash address of the data to compare
+*                       It should be in word boundary
+* @param ram_address    RAM address of the data to compare
+*                       It should be in word boundary
+* @param count          Number of bytes to compare, a multiple of 4
+* @param offset         Where the offset of the first mismatching word is
+*                       stored on COMPARE_ERROR (may be NULL)
+*
+* @return CMD_SUCCESS, COMPARE_ERROR, COUNT_ERROR or an address error
+*/
+int iap_compare(void* flash_address, void* ram_address, unsigned int count, unsigned int* offset);
+
+/**
+* Blank check flash sector(s)
+*
+* @param sector_start  The start of the sector to be checked
+* @param sector_end    The end of the sector to be checked
+* @param offset        Where the offset of the first non-blank word is stored
+*                      on SECTOR_NOT_BLANK (may be NULL)
+* @param contents      Where that word is stored (may be NULL)
+*
+* @return CMD_SUCCESS, BUSY, SECTOR_NOT_BLANK or INVALID_SECTOR
+*/
+int iap_blank_check_sector(unsigned int sector_start, unsigned int sector_end,
+        unsigned int* offset, unsigned int* contents);
+
+/**
+* Read the part identification number
+*
+* @param part_id       Where the part ID is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_part_id(unsigned int* part_id);
+
+/**
+* Read the boot code version number
+*
+* @param major         Where the major version is stored
+* @param minor         Where the minor version is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_boot_code_version(unsigned char* major, unsigned char* minor);
+
+/**
+* Read the device serial number
+*
+* @param uid           Where the four words of the serial number are stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_uid(unsigned int uid[4]);
+
+/**
+* Invoke the ISP bootloader, as if the device was reset with the ISP pin low.
+* Does not return.
+*/
+void iap_reinvoke_isp(void);
+
 #endif /* IAP_DRIVER_H_ */
@@ -25,6 +25,15 @@
 
 #ifdef HAVE_OPENSSL
 #include <openssl/md5.h>
+#define MD5_Digest(data, size, result) MD5((data), (size), (result))
+#define MD5_MAX_LANES 1
+#define MD5_x_N_select(max_lanes) 1
+static inline void MD5_x_N(const void *const *data, unsigned long size,
+	unsigned char *const *results, unsigned int n)
+{
+	while (n--)
+		MD5(*data++, size, *results++);
+}
 #elif !defined(_MD5_H)
 #define _MD5_H
 
@@ -41,5 +50,19 @@ typedef struct {
 extern void MD5_Init(MD5_CTX *ctx);
 extern void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size);
 extern void MD5_Final(unsigned char *result, MD5_CTX *ctx);
+extern void MD5_Digest(const void *data, unsigned long size,
+	unsigned char *result);
+
+/*
+ * Batch hashing of n messages of equal size, data[i] into results[i], in
+ * the vector lanes of the host CPU where it has them.  MD5_x_N_select()
+ * limits the lanes used (1 hashes one message at a time) and returns the
+ * lanes picked.
+ */
+#define MD5_MAX_LANES 16
+
+extern void MD5_x_N(const void *const *data, unsigned long size,
+	unsigned char *const *results, unsigned int n);
+extern unsigned int MD5_x_N_select(unsigned int max_lanes);
 
 #endif
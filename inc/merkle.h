@@ -0,0 +1,40 @@
+/*
+ * merkle.h
+ */
+
+#ifndef MERKLE_H_
+#define MERKLE_H_
+
+/* header fields after the part size (the rest of the header block stays zero) */
+#define ARCHIVE_FLAGS_OFFSET 9
+#define ARCHIVE_FLAG_MERKLE 0x01
+#define ARCHIVE_ROOT_OFFSET 16
+#define ARCHIVE_FOOTER_SIZE 8
+
+/* levels of a tree over up to 65535 parts, leaves included */
+#define MERKLE_MAX_LEVELS 17
+
+/* Merkle tree over the stored part hashes. The leaves are the hashes already stored
+ * in front of every part; a parent is the digest of its two children, and the last
+ * node of an odd level is carried up unchanged. Interior nodes are stored level by
+ * level, bottom up, right after the footer; the last one is the root, which is also
+ * kept in the header. */
+typedef struct {
+	uint16_t no_parts;
+	uint32_t part_size;
+	uint32_t nodes_offset;				/* flash offset of the first interior node */
+	uint32_t nodes_count;				/* number of interior nodes */
+	uint8_t levels;						/* levels, leaves included */
+	uint16_t size[MERKLE_MAX_LEVELS];	/* nodes per level */
+	uint32_t first[MERKLE_MAX_LEVELS];	/* index of the first node of a level among the interior nodes */
+} merkle_tree;
+
+/* definitions of functions */
+void merkle_layout(merkle_tree* tree, uint16_t no_parts, uint32_t part_size);
+uint32_t merkle_node_offset(const merkle_tree* tree, uint8_t level, uint16_t index);
+void merkle_combine(const uint8_t* left, const uint8_t* right, uint8_t* parent);
+uint8_t archive_is_merkle();
+uint8_t archive_verify_range(uint16_t first_part, uint16_t count, verify_result* result);
+uint8_t archive_verify_part(uint16_t part, verify_result* result);
+
+#endif /* MERKLE_H_ */
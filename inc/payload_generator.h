@@ -51,6 +51,13 @@
  *      Sector29:    0x00078000 - 0x0007FFFF        32K
  */
 
+/* Flash is mapped at address 0 on the target; a host build maps a flash image
+ * elsewhere and overrides FLASH_BASE. Sector addresses below are offsets into it. */
+#ifndef     FLASH_BASE
+#define     FLASH_BASE                  0
+#endif
+#define     FLASH_ADDRESS(offset)       ((uint8_t *)(FLASH_BASE + (offset)))
+
 /* 4K Size sectors */
 #define     FLASH_SECTOR_0_ADDRESS      0x00000000
 #define     FLASH_SECTOR_1_ADDRESS      0x00001000
@@ -124,8 +131,12 @@
 #define     FLASH_USER_SECTORS_32K              (13)
 #define     FLASH_USER_HEADER_SECTOR            (4)
 #define     FLASH_USER_PAYLOAD_START_SECTOR     (5)
+/* last payload sector, the end block follows it (benchmark builds may shorten the archive) */
+#ifndef     FLASH_USER_PAYLOAD_END_SECTOR
 #define     FLASH_USER_PAYLOAD_END_SECTOR       (27)
-#define     FLASH_USER_END_SECTOR               (28)
+#endif
+#define     FLASH_USER_END_SECTOR               (FLASH_USER_PAYLOAD_END_SECTOR + 1)
+#define     FLASH_USER_LOG_SECTOR               (29)
 #define     FLASH_BLOCK_SIZE_4K                 (4 * 1024)
 #define     FLASH_BLOCK_SIZE_32K                (32 * 1024)
 
@@ -133,7 +144,9 @@
 #define     PAYLOAD_SMALL_SIZE          (496)
 #define     PAYLOAD_MEDIUM_SIZE         (1008)
 #define     PAYLOAD_LARGE_SIZE          (2032)
+#ifndef     PAYLOAD_SIZE_BYTES
 #define     PAYLOAD_SIZE_BYTES          PAYLOAD_TINY_SIZE
+#endif
 
 #define     MD5_HASH_SIZE_BYTES         (16)
 #define     MD5_BUFFER_SIZE_BYTES       (64)
@@ -142,44 +155,167 @@
 #define     PAYLOAD_BLOCK_PIECES        (FLASH_BLOCK_SIZE_4K / PAYLOAD_BLOCK_SIZE)
 #define     PAYLOAD_BLOCK_PIECES_32K    (FLASH_BLOCK_SIZE_32K / FLASH_BLOCK_SIZE_4K)
 
+#if (FLASH_BLOCK_SIZE_4K % PAYLOAD_BLOCK_SIZE) != 0
+#error "Payload blocks must tile a 4K block exactly, use one of the PAYLOAD_*_SIZE values"
+#endif
+#if FLASH_USER_PAYLOAD_END_SECTOR < FLASH_USER_PAYLOAD_START_SECTOR || FLASH_USER_END_SECTOR >= FLASH_USER_LOG_SECTOR
+#error "FLASH_USER_PAYLOAD_END_SECTOR must leave room for the end block and the log sector"
+#endif
+
+/* generator_get_fault when an install found no fault */
+#define     GENERATOR_NO_FAULT              (0xFFFFFFFF)
+
 #define     FLASH_USER_END_BLOCK_DATA       (0xAB)
 #define     FLASH_USER_HEADER_BLOCK_DATA    (0xABBA)
 
-static unsigned int sector_start_address[] = {
-    (unsigned int) FLASH_SECTOR_0_ADDRESS,
-    (unsigned int) FLASH_SECTOR_1_ADDRESS,
-    (unsigned int) FLASH_SECTOR_2_ADDRESS,
-    (unsigned int) FLASH_SECTOR_3_ADDRESS,
-    (unsigned int) FLASH_SECTOR_4_ADDRESS,
-    (unsigned int) FLASH_SECTOR_5_ADDRESS,
-    (unsigned int) FLASH_SECTOR_6_ADDRESS,
-    (unsigned int) FLASH_SECTOR_7_ADDRESS,
-    (unsigned int) FLASH_SECTOR_8_ADDRESS,
-    (unsigned int) FLASH_SECTOR_9_ADDRESS,
-    (unsigned int) FLASH_SECTOR_10_ADDRESS,
-    (unsigned int) FLASH_SECTOR_11_ADDRESS,
-    (unsigned int) FLASH_SECTOR_12_ADDRESS,
-    (unsigned int) FLASH_SECTOR_13_ADDRESS,
-    (unsigned int) FLASH_SECTOR_14_ADDRESS,
-    (unsigned int) FLASH_SECTOR_15_ADDRESS,
-    (unsigned int) FLASH_SECTOR_16_ADDRESS,
-    (unsigned int) FLASH_SECTOR_17_ADDRESS,
-    (unsigned int) FLASH_SECTOR_18_ADDRESS,
-    (unsigned int) FLASH_SECTOR_19_ADDRESS,
-    (unsigned int) FLASH_SECTOR_20_ADDRESS,
-    (unsigned int) FLASH_SECTOR_21_ADDRESS,
-    (unsigned int) FLASH_SECTOR_22_ADDRESS,
-    (unsigned int) FLASH_SECTOR_23_ADDRESS,
-    (unsigned int) FLASH_SECTOR_24_ADDRESS,
-    (unsigned int) FLASH_SECTOR_25_ADDRESS,
-    (unsigned int) FLASH_SECTOR_26_ADDRESS,
-    (unsigned int) FLASH_SECTOR_27_ADDRESS,
-    (unsigned int) FLASH_SECTOR_28_ADDRESS,
-    (unsigned int) FLASH_SECTOR_29_ADDRESS
-};
-
-/**
-* Fill flash with the payload
+/* generator of the random payload data; parts are seeded with their flash
+ * address plus their index in the 4K block either way */
+typedef enum {
+    PAYLOAD_PRNG_NEWLIB = 0,    /* srand/rand, a byte per call, as older builds wrote images */
+    PAYLOAD_PRNG_XORSHIFT,      /* xorshift32, a word per step, seed scheme PAYLOAD_SEED_VERSION */
+} e_payload_prng;
+
+#define     PAYLOAD_PRNG_DEFAULT        PAYLOAD_PRNG_XORSHIFT
+
+/* how a part's xorshift state is derived from its seed, bump when it changes */
+#define     PAYLOAD_SEED_VERSION        (1)
+
+/* progress of write_payload: bytes programmed so far out of the payload total */
+typedef void (*generator_progress)(uint32_t written, uint32_t total);
+
+/* start address of every flash sector, indexed by sector number */
+extern const unsigned int sector_start_address[];
+
+/**
+* Initialize given payload with random data
+*
+* @param payload        Data to fill
+* @param size           Size of the data
+* @param seed           Seed of the part, its flash address plus its index in the 4K block
+*/
+void seed_payload(uint8_t payload[], uint32_t size, int seed);
+
+/**
+* Fill in the fields of a header block
+*
+* @param block          Header block, zero except for the fields
+* @param chunks         Number of parts
+* @param size           Size of a part, its hash included
+* @param root           Merkle root of a tree archive, 0 for a flat archive
+* @param algorithm      Digest of the part hashes (e_digest_algorithm)
+*/
+void build_header(uint8_t block[], uint16_t chunks, uint32_t size, const uint8_t* root, uint8_t algorithm);
+
+/**
+* Write to flash the start block
+*
+* @return IAP status codes
+*/
+int write_header(void);
+
+/**
+* Write to flash the payload blocks, seeding and hashing the next block while
+* the previous one is being programmed
+*
+* @return IAP status codes
+*/
+int write_payload(void);
+
+/**
+* Update the payload blocks in place, erasing and programming only the sectors
+* holding parts whose hashes differ from those in flash
+*
+* @return IAP status codes
+*/
+int write_payload_delta(void);
+
+/**
+* Write to flash the end block
+*
+* @return IAP status codes
+*/
+int write_end(void);
+
+/**
+* Write to flash the end block followed by the Merkle tree
+*
+* @return IAP status codes
+*/
+int write_merkle_end(void);
+
+/**
+* Select whether generator_init writes the Merkle tree variant of the archive
+*
+* @param enabled    Write a tree after the footer and its root in the header
+*/
+void generator_set_merkle(uint8_t enabled);
+
+/**
+* Select whether generator_init installs the archive, validating every 4K block
+* before it is programmed and comparing flash with it afterwards
+*
+* @param enabled    Validate and read back every block
+*/
+void generator_set_install(uint8_t enabled);
+
+/**
+* Get where the last install found a fault
+*
+* @return flash offset of the first bad part or mismatching word,
+*         GENERATOR_NO_FAULT if none was found
+*/
+uint32_t generator_get_fault(void);
+
+/**
+* Select whether generator_init updates an archive of the same layout in place,
+* re-flashing only the sectors holding parts whose hashes changed
+*
+* @param enabled    Compare the new part hashes with those in flash first
+*/
+void generator_set_delta(uint8_t enabled);
+
+/**
+* Get the number of payload sectors the last generator_init erased and programmed
+*
+* @return sectors written
+*/
+uint16_t generator_sectors_written(void);
+
+/**
+* Select the generator of the random payload data
+*
+* @param prng           PAYLOAD_PRNG_XORSHIFT, or PAYLOAD_PRNG_NEWLIB to
+*                       reproduce images of older builds
+*/
+void generator_set_prng(e_payload_prng prng);
+
+/**
+* Set the function write_payload reports its progress to
+*
+* @param callback       Called after every block is programmed, 0 for none
+*/
+void generator_set_progress(generator_progress callback);
+
+/**
+* Select the digest generator_init hashes the parts with and names in the header
+*
+* @param algorithm      DIGEST_MD5, DIGEST_CRC32 or DIGEST_SHA256
+*/
+void generator_set_digest(uint8_t algorithm);
+
+/**
+* Erase a range of sectors, skipping those that are already blank
+*
+* @param sector_start   First sector of the range
+* @param sector_end     Last sector of the range
+*
+* @return IAP status codes
+*/
+int erase_sectors(unsigned int sector_start, unsigned int sector_end);
+
+/**
+* Fill flash with the payload. In delta mode an archive of the same layout
+* already in flash is updated in place instead.
 *
 * @return IAP status codes
 */
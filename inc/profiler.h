@@ -0,0 +1,51 @@
+/*
+ * profiler.h
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include "timer.h"
+
+/* record cycle counts of the verification phases (comment out to compile the probes away) */
+#define VERIFY_PROFILING 1
+
+/* phases of verify that are profiled */
+typedef enum {
+	PROFILE_VERIFY = 0,		/* the whole verify call */
+	PROFILE_HEADER,			/* preamble and footer checks */
+	PROFILE_DMA_WAIT,		/* waiting for the next block to land */
+	PROFILE_HASH,			/* calculate_part_hash */
+	PROFILE_COMPARE,		/* comparing the stored hash */
+	PROFILE_REARM,			/* releasing a block and re-arming the ring */
+	PROFILE_IRQ,			/* DMA interrupt handler, including its re-arming */
+	PROFILE_DMA_IDLE,		/* no block in flight while blocks are left to move */
+	PROFILE_PHASES
+} e_profile_phase;
+
+/* cycle statistics of a single phase */
+typedef struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+} profile_phase;
+
+/* definition of global variable (statistics of the last profiled verify, readable
+ * from a debugger or reported by the application) */
+extern profile_phase verify_profile[PROFILE_PHASES];
+
+/* probes placed around the profiled phases */
+#ifdef VERIFY_PROFILING
+#define PROFILE_BEGIN(start) ((start) = timer_cycles())
+#define PROFILE_END(phase, start) profiler_record((phase), (start))
+#else
+#define PROFILE_BEGIN(start) ((void)(start))
+#define PROFILE_END(phase, start) ((void)(start))
+#endif
+
+/* definitions of functions */
+void profiler_reset();
+void profiler_record(e_profile_phase phase, uint32_t start);
+
+#endif /* PROFILER_H_ */
@@ -0,0 +1,12 @@
+/*
+ * timer.h
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+/* definitions of functions */
+void timer_init();
+uint32_t timer_cycles();
+
+#endif /* TIMER_H_ */
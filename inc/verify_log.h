@@ -0,0 +1,53 @@
+/*
+ * verify_log.h
+ */
+
+#ifndef VERIFY_LOG_H_
+#define VERIFY_LOG_H_
+
+#include "md5.h"
+
+/* records are appended to the log sector in the smallest unit IAP can program */
+#define VERIFY_LOG_RECORD_SIZE 256
+#define VERIFY_LOG_SECTOR_SIZE FLASH_BLOCK_SIZE_32K
+#define VERIFY_LOG_SLOTS (VERIFY_LOG_SECTOR_SIZE / VERIFY_LOG_RECORD_SIZE)
+#define VERIFY_LOG_ADDRESS FLASH_ADDRESS(FLASH_SECTOR_29_ADDRESS)
+#define VERIFY_LOG_MAGIC 0x564C4F47UL
+
+/* header bytes a record is tied to (preamble, part count, part size and the
+ * reserved fields after them) */
+#define ARCHIVE_HEADER_SIZE 32
+
+/* kinds of log records */
+typedef enum {
+	VERIFY_LOG_CHECKPOINT = 1,		/* parts [0, next_part) have been verified */
+	VERIFY_LOG_VERIFIED,			/* all next_part parts verified, the archive is valid */
+	VERIFY_LOG_DMA_TUNING,			/* the DMA control template DMA_autotune picked */
+} e_verify_log_kind;
+
+/* a log record, programmed in one IAP write */
+typedef struct {
+	uint32_t magic;
+	uint8_t kind;
+	uint8_t reserved;
+	uint16_t next_part;
+	uint8_t header_digest[HASH_SIZE];	/* MD5 of the archive header */
+	uint8_t hashes_digest[HASH_SIZE];	/* MD5 over the stored hashes of parts [0, next_part) */
+	uint32_t dma_control;				/* control template of a tuning record */
+	uint8_t record_digest[HASH_SIZE];	/* MD5 of the fields above, detects torn writes */
+	uint8_t padding[VERIFY_LOG_RECORD_SIZE - 60];
+} verify_log_record;
+
+/* definitions of functions */
+void verify_log_header_digest(uint8_t* digest);
+uint8_t verify_log_latest(verify_log_record* record);
+int verify_log_append(verify_log_record* record);
+int verify_log_save(e_verify_log_kind kind, uint16_t next_part, const MD5_CTX* hashes);
+uint16_t checkpoint_resume(uint16_t no_parts, uint32_t part_size, MD5_CTX* hashes);
+int checkpoint_save(uint16_t next_part, const MD5_CTX* hashes);
+uint8_t verify_cache_lookup(uint16_t no_parts, uint32_t part_size);
+int verify_cache_store(uint16_t no_parts, const MD5_CTX* hashes);
+uint8_t verify_log_tuning(uint32_t* control);
+int verify_log_save_tuning(uint32_t control);
+
+#endif /* VERIFY_LOG_H_ */
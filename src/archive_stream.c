@@ -0,0 +1,167 @@
+/*
+ * archive_stream.c
+ *
+ * Push-style verification of an archive arriving in chunks from any source
+ * (UART, SPI, a file on the host). Every part is hashed as its bytes come in,
+ * so a package can be verified while it is still being received instead of
+ * being written to flash and read back.
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <string.h>
+#include "digest.h"
+#include "payload_generator.h"
+#include "definitions.h"
+#include "archive_stream.h"
+
+/**
+* Check the header fields once they have all been received
+*
+* @param stream		Stream state
+*
+* @return the archive can be verified or cannot
+*/
+static uint8_t stream_check_fields(archive_stream* stream) {
+	stream->no_parts = get_two_bytes(&stream->fields[2]);
+	stream->part_size = get_four_bytes(&stream->fields[4]);
+	stream->digest = digest_backend_of(stream->fields[ARCHIVE_DIGEST_OFFSET]);
+
+	if (get_two_bytes(stream->fields) != VALID_PREAMBLE)
+		stream->result.status = VERIFY_BAD_PREAMBLE;
+	else if (stream->part_size <= HASH_SIZE || !stream->no_parts || !stream->digest ||
+			stream->fields[ARCHIVE_DIGEST_OFFSET] != verify_get_required_digest())
+		stream->result.status = VERIFY_BAD_LAYOUT;
+	else
+		stream->digest->init(&stream->context);
+
+	return stream->result.status == VERIFY_OK;
+}
+
+/**
+* Compare the hash of a fully received part with the one stored in front of it
+*
+* @param stream		Stream state
+*
+* @return keep going or stop (the part is bad and not every part is scanned)
+*/
+static uint8_t stream_finish_part(archive_stream* stream) {
+	uint8_t digest[HASH_SIZE];
+
+	stream->digest->final(&stream->context, digest);
+	if (memcmp(digest, stream->expected, HASH_SIZE) &&
+			!record_bad_part(&stream->result, stream->part, stream->expected, digest, stream->part_size))
+		return 0;
+
+	stream->offset = 0;
+	if (++stream->part == stream->no_parts)
+		stream->phase = STREAM_FOOTER;
+	else
+		stream->digest->init(&stream->context);
+	return 1;
+}
+
+/**
+* Start verifying a streamed archive
+*
+* @param stream		Stream state to set up
+* @param scan_all	Continue past mismatching parts and map all of them
+*/
+void archive_stream_begin(archive_stream* stream, uint8_t scan_all) {
+	memset(stream, 0, sizeof(*stream));
+	stream->phase = STREAM_HEADER;
+	verify_result_init(&stream->result, scan_all);
+}
+
+/**
+* Feed the next chunk of a streamed archive. Chunks may be of any length and a
+* part may straddle any number of them.
+*
+* @param stream		Stream state
+* @param data		Bytes received
+* @param length		Number of bytes received
+*
+* @return keep feeding or the archive is already known to be invalid
+*/
+uint8_t archive_stream_feed(archive_stream* stream, const uint8_t* data, uint32_t length) {
+	uint32_t take;
+
+	while (length && stream->phase != STREAM_DONE) {
+		switch (stream->phase) {
+		case STREAM_HEADER:
+			take = ARCHIVE_STREAM_HEADER_SIZE - stream->offset;
+			if (take > length) take = length;
+
+			/* the fields sit at the start of the header block, the rest is skipped */
+			if (stream->offset < ARCHIVE_STREAM_FIELDS_SIZE) {
+				if (take > ARCHIVE_STREAM_FIELDS_SIZE - stream->offset)
+					take = ARCHIVE_STREAM_FIELDS_SIZE - stream->offset;
+				memcpy(&stream->fields[stream->offset], data, take);
+				if (stream->offset + take == ARCHIVE_STREAM_FIELDS_SIZE && !stream_check_fields(stream))
+					stream->phase = STREAM_DONE;
+			}
+
+			stream->offset += take;
+			if (stream->offset == ARCHIVE_STREAM_HEADER_SIZE) {
+				stream->phase = STREAM_PARTS;
+				stream->offset = 0;
+			}
+			break;
+
+		case STREAM_PARTS:
+			/* the stored hash, then the data hashed as it arrives */
+			if (stream->offset < HASH_SIZE) {
+				take = HASH_SIZE - stream->offset;
+				if (take > length) take = length;
+				memcpy(&stream->expected[stream->offset], data, take);
+			}
+			else {
+				take = stream->part_size - stream->offset;
+				if (take > length) take = length;
+				stream->digest->update(&stream->context, data, take);
+			}
+
+			stream->offset += take;
+			if (stream->offset == stream->part_size && !stream_finish_part(stream))
+				stream->phase = STREAM_DONE;
+			break;
+
+		case STREAM_FOOTER:
+			take = ARCHIVE_STREAM_FOOTER_SIZE - stream->offset;
+			if (take > length) take = length;
+			memcpy(&stream->footer[stream->offset], data, take);
+
+			stream->offset += take;
+			if (stream->offset == ARCHIVE_STREAM_FOOTER_SIZE) {
+				if (get_eight_bytes(stream->footer) != VALID_FOOTER && stream->result.status == VERIFY_OK)
+					stream->result.status = VERIFY_BAD_FOOTER;
+				stream->phase = STREAM_DONE;
+			}
+			break;
+
+		default:
+			take = length;
+			break;
+		}
+
+		data += take;
+		length -= take;
+	}
+
+	return stream->result.status == VERIFY_OK;
+}
+
+/**
+* Finish verifying a streamed archive
+*
+* @param stream		Stream state, its result holds the report
+*
+* @return archive is valid or archive is not valid
+*/
+uint8_t archive_stream_end(archive_stream* stream) {
+	if (stream->phase != STREAM_DONE && stream->result.status == VERIFY_OK)
+		stream->result.status = VERIFY_TRUNCATED;
+
+	return stream->result.status == VERIFY_OK;
+}
@@ -9,26 +9,140 @@ AllCodes.c
 #endif
 
 #include <cr_section_macros.h>
+#include <string.h>
 #include "md5.h"
 #include "iap_driver.h"
 #include "payload_generator.h"
 #include "definitions.h"
 #include "leds.h"
+#include "timer.h"
+#include "profiler.h"
+#include "verify_log.h"
+#include "digest.h"
+#include "merkle.h"
 
-/* declaration of a global variable that indicates whether a transfer has finished */
-volatile uint8_t transfer_finished = 0;
+/* declaration of a global bitmask that indicates which channels have finished a transfer */
+volatile uint8_t channels_finished = 0;
+
+/* channel register blocks, indexed by channel number */
+static LPC_GPDMACH_TypeDef* const dma_channels[8] = {
+	LPC_GPDMACH0, LPC_GPDMACH1, LPC_GPDMACH2, LPC_GPDMACH3,
+	LPC_GPDMACH4, LPC_GPDMACH5, LPC_GPDMACH6, LPC_GPDMACH7
+};
+
+/* RAM blocks the payload is streamed through, placed in the AHB SRAM banks
+ * (the only data in RAM2, so dma_ring[0] starts at bank 0 and dma_ring[1] at bank 1).
+ * Consecutive blocks alternate banks, so the GPDMA writing one block and the
+ * CPU hashing the previous one sit on different bus matrix slaves. */
+__NOINIT(RAM2) static uint8_t dma_ring[2][AHB_SRAM_BANK_SIZE / RAM_BLOCK_SIZE][RAM_BLOCK_SIZE];
+#define DMA_RING_BLOCK(slot) (dma_ring[(slot) & 1][(slot) >> 1])
+
+/* linked list items describing the whole payload, one per RAM block */
+static DMA_LLI dma_lli[DMA_MAX_LLI];
+
+/* state of the ring shared between verify and the interrupt handler:
+ * blocks_requested   - blocks handed to the controller so far
+ * blocks_transferred - blocks that reached terminal count (producer index)
+ * blocks_verified    - blocks whose parts have been hashed (consumer index)
+ * slots_ready        - bit n is set while RAM block n holds a landed, unverified block */
+static e_dma_policy dma_policy = DMA_DEFAULT_POLICY;
+static uint32_t dma_control_template = DMA_DEFAULT_CONTROL;
+static uint16_t blocks_total;
+static volatile uint16_t blocks_requested;
+static volatile uint16_t blocks_transferred;
+static volatile uint16_t blocks_verified;
+static volatile uint8_t slots_ready;
+static volatile uint8_t dma_error;
+static volatile uint8_t ring_active = 0;
+
+/* set while no block is in flight although blocks are left to move, and when that began */
+static uint8_t dma_idle;
+static uint32_t dma_idle_start;
+
+/* set while the ring must not be refilled (a checkpoint is being programmed) */
+static volatile uint8_t dma_hold;
+
+/* progress checkpoints and the verified-archive cache:
+ * checkpoint_interval - parts between checkpoints, 0 disables them
+ * verify_cache        - skip the payload when the archive is the one last verified valid
+ * hashes_tracked      - checkpoint_hashes is kept up to date during this verify
+ * checkpoint_hashes   - running digest of the stored hashes of the parts verified so far
+ * checkpoint_last     - parts covered by the newest checkpoint
+ * checkpoint_written  - a resumable checkpoint exists and must be closed once done */
+static uint16_t checkpoint_interval = 0;
+static uint8_t verify_cache = 0;
+static uint8_t hashes_tracked;
+static MD5_CTX checkpoint_hashes;
+static uint16_t checkpoint_last;
+static uint8_t checkpoint_written;
+
+/* engine used by verify */
+static e_verify_engine verify_engine = VERIFY_DEFAULT_ENGINE;
+
+/* digest an archive must be hashed with to verify. The header names its digest,
+ * but the header is not authenticated, so it is only accepted when it names this one. */
+static uint8_t verify_required_digest = DIGEST_MD5;
+
+/**
+* Count the blocks channel 0 has finished moving. Terminal count interrupts can
+* coalesce, so the count is read from the channel rather than from the interrupts:
+* while it moves item i its LLI register points at item i + 1 (0 at the end of a
+* window), and it is disabled once the window is done.
+*
+* @return blocks of the chain moved so far
+*/
+static uint16_t DMA_chain_done() {
+	uintptr_t next;
+
+	if (!(LPC_GPDMACH0->DMACCConfig & 1)) return blocks_requested;
+	next = LPC_GPDMACH0->DMACCLLI;
+	if (!next) return blocks_requested - 1;
+	return (uint16_t) ((DMA_LLI*) next - dma_lli) - 1;
+}
 
 /**
 * DMA interrupt handler
 */
 void DMA_IRQHandler(void) {
-	/* clear the flags causing the interrupt */
-	LPC_GPDMA->DMACIntTCClear |= 0xFF;
-	LPC_GPDMA -> DMACIntErrClr |= 0xFF;
+	uint8_t tc, err, channel;
+	uint16_t done;
+	uint32_t start;
+
+	PROFILE_BEGIN(start);
+
+	/* read and clear the flags causing the interrupt */
+	tc = LPC_GPDMA->DMACIntTCStat;
+	err = LPC_GPDMA->DMACIntErrStat;
+	LPC_GPDMA->DMACIntTCClear = tc;
+	LPC_GPDMA->DMACIntErrClr = err;
 
-	/* indicate that the transfer has finished */
-	transfer_finished = 1;
+	/* indicate which transfers have finished */
+	channels_finished |= tc;
+	if (err) dma_error = 1;
 
+	/* account for the blocks moved since the last interrupt, keep the ring filled */
+	if (ring_active && tc) {
+		if (dma_policy == DMA_POLICY_STRIPED) {
+			/* the channel number is the RAM block number, and a channel moves one
+			 * block until it is restarted, so each flag is a single block */
+			for (channel=0; channel<DMA_RING_DEPTH; channel++)
+				if (tc & (1 << channel)) {
+					slots_ready |= 1 << channel;
+					blocks_transferred++;
+				}
+		}
+		else {
+			/* channel 0 lands blocks in order, one interrupt may stand for several */
+			done = DMA_chain_done();
+			while (blocks_transferred < done) {
+				slots_ready |= 1 << (blocks_transferred % DMA_RING_DEPTH);
+				blocks_transferred++;
+			}
+		}
+		DMA_refill_ring();
+	}
+
+	PROFILE_END(PROFILE_IRQ, start);
 }
 
 /**
@@ -96,6 +210,15 @@ uint32_t get_part_size() {
 	return get_four_bytes(HEADER_ADDRESS + 4);
 }
 
+/**
+* Get the digest the parts of the archive are hashed with
+*
+* @return the e_digest_algorithm byte of the header
+*/
+uint8_t get_digest_algorithm() {
+	return HEADER_ADDRESS[ARCHIVE_DIGEST_OFFSET];
+}
+
 /**
 * Get the footer of the archive
 *
@@ -109,16 +232,30 @@ uint64_t get_footer(uint32_t part_size, uint16_t no_of_parts) {
 }
 
 /**
-* Calculate the hash of a given part
+* Check that the parts the header describes, the footer and what follows it fit
+* in the flash reserved for the archive, which ends with the end sector
+*
+*@param part_size		Size of a single part
+*@param no_of_parts		Number of parts in the archive
+*@param tail_size		Bytes stored after the footer
+*
+* @return archive fits or does not fit
+*/
+uint8_t archive_fits(uint32_t part_size, uint16_t no_of_parts, uint32_t tail_size) {
+	if (part_size <= HASH_SIZE || !no_of_parts) return 0;
+	return PART_STARTING_OFFSET + (uint64_t)no_of_parts * part_size + ARCHIVE_FOOTER_SIZE + tail_size
+			<= sector_start_address[FLASH_USER_END_SECTOR + 1];
+}
+
+/**
+* Calculate the hash of a given part with the selected digest
 *
-* @param part address
-* @param part size
+* @param part		Part address (the stored hash followed by the data)
+* @param part_size	Size of the part data
+* @param digest		Where the 16-byte hash of the data is written
 */
-void calculate_part_hash(uint8_t* part, uint32_t part_size) {
-	MD5_CTX ctx;
-	MD5_Init(&ctx);
-	MD5_Update(&ctx, &part[HASH_SIZE], part_size);
-	MD5_Final(part, &ctx);
+void calculate_part_hash(const uint8_t* part, uint32_t part_size, uint8_t* digest) {
+	digest_selected()->digest(&part[HASH_SIZE], part_size, digest);
 }
 
 /**
@@ -141,6 +278,103 @@ void DMA_init() {
 	NVIC_EnableIRQ(DMA_IRQn);
 }
 
+/**
+* Get the channel control word for a transfer, built from the control template
+*
+* @param transfer_size		Number of items (of the template's width) to transfer
+*
+* @return the value for the DMACCControl register
+*/
+uint32_t DMA_control_word(uint16_t transfer_size) {
+	return dma_control_template | transfer_size;
+}
+
+/**
+* Check whether a whole RAM block can be moved in a single transfer of a given width
+*
+* @param width		BYTE_WIDTH, HALFWORD_WIDTH or WORD_WIDTH
+*
+* @return fits or does not fit
+*/
+uint8_t DMA_width_fits(uint8_t width) {
+	return (RAM_BLOCK_SIZE >> width) <= DMA_MAX_ITEMS;
+}
+
+/**
+* Set the control template used by all following transfers (ignored while verifying
+* or when its width cannot move a whole RAM block)
+*
+* @param control	Template built with DMA_CONTROL
+*/
+void DMA_set_control_template(uint32_t control) {
+	if (!ring_active && DMA_width_fits(DMA_CONTROL_WIDTH(control)))
+		dma_control_template = control;
+}
+
+/**
+* Get the control template used for transfers
+*
+* @return the template, without a transfer size
+*/
+uint32_t DMA_get_control_template() {
+	return dma_control_template;
+}
+
+/**
+* Find the fastest burst sizes for flash to RAM transfers on this board. Every
+* SBSize/DBSize combination is timed moving the first RAM block of the payload
+* into the ring at the width of the current template; the winner is kept as the
+* control template for subsequent verify runs and stored in the log sector, so
+* later boots take it from there instead of sweeping again.
+*
+* @return the winning control template
+*/
+uint32_t DMA_autotune() {
+	uint8_t sb_size, db_size, width, round;
+	uint32_t control, start, cycles, best_cycles = 0xFFFFFFFF;
+	uint32_t best_control = dma_control_template;
+
+	if (ring_active) return dma_control_template;
+
+	/* a template tuned on an earlier boot is used as it is */
+	width = DMA_CONTROL_WIDTH(dma_control_template);
+	if (verify_log_tuning(&control) && DMA_CONTROL_WIDTH(control) == width) {
+		dma_control_template = control;
+		return control;
+	}
+
+	DMA_init();
+	timer_init();
+
+	for (sb_size=0; sb_size<8; sb_size++)
+		for (db_size=0; db_size<8; db_size++) {
+			control = DMA_CONTROL(sb_size, db_size, width);
+			dma_control_template = control;
+
+			/* time a few back to back transfers of a whole RAM block */
+			start = timer_cycles();
+			for (round=0; round<DMA_AUTOTUNE_ROUNDS; round++) {
+				DMA_transfer(PART_STARTING_ADDRESS, DMA_RING_BLOCK(0),
+						RAM_BLOCK_SIZE >> width);
+				while (!(channels_finished & 1)) CPU_RELAX();
+			}
+			cycles = timer_cycles() - start;
+
+			if (cycles < best_cycles) {
+				best_cycles = cycles;
+				best_control = control;
+			}
+		}
+
+	dma_control_template = best_control;
+
+	/* the transfers are done, nothing fetches from flash while the log is programmed */
+	NVIC_DisableIRQ(DMA_IRQn);
+	verify_log_save_tuning(best_control);
+	NVIC_EnableIRQ(DMA_IRQn);
+	return best_control;
+}
+
 /**
 * Initiate a DMA transfer
 *
@@ -150,44 +384,382 @@ void DMA_init() {
 */
 void DMA_transfer(uint8_t* src_addr, uint8_t* dest_addr, uint16_t transfer_size) {
 
+	/* indicate that the transfer has not finished */
+	channels_finished &= ~1;
+
 	/* set source and destination address */
-	LPC_GPDMACH0->DMACCSrcAddr = src_addr;
-	LPC_GPDMACH0->DMACCDestAddr = dest_addr;
+	LPC_GPDMACH0->DMACCSrcAddr = (uintptr_t) src_addr;
+	LPC_GPDMACH0->DMACCDestAddr = (uintptr_t) dest_addr;
 
 	/* not using linked list */
 	LPC_GPDMACH0->DMACCLLI = 0;
 
-	/* set the control register (burst size 1 by default) */
-	LPC_GPDMACH0->DMACCControl = (transfer_size) | (TRANSFER_WIDTH << 18) |
-			(TRANSFER_WIDTH << 21) | (1 << 26) | (1 << 27) | (1 << 31);
+	/* set the control register */
+	LPC_GPDMACH0->DMACCControl = DMA_control_word(transfer_size);
 
-	/* indicate that the transfer has not finished and enable channel */
-	transfer_finished = 0;
+	/* enable channel */
 	LPC_GPDMACH0->DMACCConfig = 0x0C001;
 
 }
 
 /**
-* Calculate the transfer size and initiate a DMA transfer
+* Select how verify moves the payload into the ring (ignored while verifying)
+*
+* @param policy		One of the DMA_POLICY_* values
+*/
+void DMA_set_policy(e_dma_policy policy) {
+	if (!ring_active) dma_policy = policy;
+}
+
+/**
+* Get the policy verify uses to move the payload into the ring
+*
+* @return the current DMA_POLICY_* value
+*/
+e_dma_policy DMA_get_policy() {
+	return dma_policy;
+}
+
+/**
+* Stop every ring channel and drop the ring, so nothing is written to RAM
+* blocks after verification returns
+*/
+void DMA_stop() {
+	uint8_t channel;
+
+	ring_active = 0;
+	for (channel=0; channel<DMA_RING_DEPTH; channel++)
+		dma_channels[channel]->DMACCConfig = 0;
+	while (LPC_GPDMA->DMACEnbldChns & ((1 << DMA_RING_DEPTH) - 1)) CPU_RELAX();
+}
+
+/**
+* Load a linked list item into a channel and enable it
 *
-* @param src_addr				Source address of of the transfer
-* @param dest_addr				Destination address of the transfer
-* @param parts_to_transfer		Number of parts left to transfer
-* @param block_capacity			Number of parts a block can store
-* @param part_size				Size of a single part
+* @param channel	Channel registers
+* @param item		Item to start the channel with
+*/
+void DMA_start_item(LPC_GPDMACH_TypeDef* channel, DMA_LLI* item) {
+	channel->DMACCSrcAddr = item->src_addr;
+	channel->DMACCDestAddr = item->dest_addr;
+	channel->DMACCLLI = item->next_lli;
+	channel->DMACCControl = item->control;
+	channel->DMACCConfig = 0x0C001;
+}
+
+/**
+* Build the linked list items that move the payload into the ring.
+* Item i copies block i into RAM block (i % DMA_RING_DEPTH); the items are
+* linked together window by window in DMA_refill_ring.
+*
+* @param src_addr			Address of the first part in flash
+* @param no_blocks			Number of blocks the payload is split into
+* @param block_bytes		Size of a full block in bytes
+* @param last_block_bytes	Size of the last block in bytes
+*
+* @return number of items built, 0 if the payload does not fit DMA_MAX_LLI or
+*         the blocks are not whole items of the transfer width
+*/
+uint16_t DMA_build_chain(uint8_t* src_addr, uint16_t no_blocks,
+		uint32_t block_bytes, uint32_t last_block_bytes) {
+	uint16_t i;
+	uint8_t width = DMA_CONTROL_WIDTH(dma_control_template);
+
+	/* blocks must be whole items of the transfer width */
+	if (!no_blocks || no_blocks > DMA_MAX_LLI) return 0;
+	if ((block_bytes | last_block_bytes) & ((1 << width) - 1)) return 0;
+
+	for (i=0; i<no_blocks; i++) {
+		dma_lli[i].src_addr = (uintptr_t) (src_addr + (uint32_t)i * block_bytes);
+		dma_lli[i].dest_addr = (uintptr_t) DMA_RING_BLOCK(i % DMA_RING_DEPTH);
+		dma_lli[i].next_lli = 0;
+		dma_lli[i].control = DMA_control_word(
+				((i == no_blocks - 1)? last_block_bytes : block_bytes) >> width);
+	}
+
+	blocks_total = no_blocks;
+	blocks_requested = blocks_transferred = blocks_verified = 0;
+	slots_ready = dma_error = 0;
+	dma_idle = dma_hold = 0;
+	ring_active = 1;
+
+	return no_blocks;
+}
+
+/**
+* Record the time the controller sits idle with blocks left to move, which is
+* time the ring is full and waiting for verify to release a block
+*/
+static void DMA_track_idle() {
+#ifdef VERIFY_PROFILING
+	uint8_t idle = blocks_requested == blocks_transferred && blocks_requested < blocks_total;
+
+	if (idle && !dma_idle) PROFILE_BEGIN(dma_idle_start);
+	else if (!idle && dma_idle) PROFILE_END(PROFILE_DMA_IDLE, dma_idle_start);
+	dma_idle = idle;
+#endif
+}
+
+/**
+* Hand the controller the next blocks. In linked list mode a window covers
+* every free RAM block, so the channel streams through it without the CPU
+* re-arming it; in single mode a window is a single one-shot block. In
+* striped mode every free RAM block is started on its own channel. Called
+* from the interrupt handler and from verify (with the DMA interrupt masked)
+* once a block is released.
 */
-void transfer_to_RAM(uint8_t* src_addr, uint8_t* dest_addr, uint16_t* parts_to_transfer,
-		uint16_t* block_capacity, uint32_t* part_size){
+void DMA_refill_ring() {
+	uint16_t first, window, i;
 
-	/* initiate a DMA transfer for the appropriate transfer size */
-	if (*parts_to_transfer < *block_capacity) {
-		DMA_transfer(src_addr, dest_addr, (*parts_to_transfer * *part_size) >> TRANSFER_WIDTH);
-		*parts_to_transfer = 0;
+	/* flash is being programmed */
+	if (dma_hold) {
+		DMA_track_idle();
+		return;
 	}
-	else {
-		DMA_transfer(src_addr, dest_addr, TRANSFER_SIZE);
-		*parts_to_transfer -= *block_capacity;
+
+	/* start a one-shot transfer on the channel of every free RAM block */
+	if (dma_policy == DMA_POLICY_STRIPED) {
+		while (blocks_requested < blocks_total &&
+				(uint16_t)(blocks_requested - blocks_verified) < DMA_RING_DEPTH) {
+			DMA_start_item(dma_channels[blocks_requested % DMA_RING_DEPTH], &dma_lli[blocks_requested]);
+			blocks_requested++;
+		}
+		DMA_track_idle();
+		return;
 	}
+
+	/* the current window is still streaming */
+	if (blocks_requested != blocks_transferred) return;
+
+	/* the window is bounded by free RAM blocks and by the blocks left */
+	first = blocks_requested;
+	window = DMA_RING_DEPTH - (blocks_requested - blocks_verified);
+	if (window > blocks_total - first) window = blocks_total - first;
+	if (dma_policy == DMA_POLICY_SINGLE && window > 1) window = 1;
+	if (!window) {
+		DMA_track_idle();
+		return;
+	}
+
+	/* link the items of the window and terminate the chain at its end */
+	for (i=first; i<first + window - 1; i++)
+		dma_lli[i].next_lli = (uintptr_t) &dma_lli[i + 1];
+	dma_lli[first + window - 1].next_lli = 0;
+
+	/* start channel 0 on the first item */
+	blocks_requested += window;
+	DMA_track_idle();
+	DMA_start_item(LPC_GPDMACH0, &dma_lli[first]);
+}
+
+/**
+* Record a part whose stored hash does not match its data
+*
+* @param result		Verification report
+* @param part		Index of the part in the archive
+* @param stored		Hash stored with the part
+* @param digest		Hash calculated over the part data
+* @param part_size	Size of a single part
+*
+* @return whether verification should continue past the part
+*/
+uint8_t record_bad_part(verify_result* result, uint16_t part, const uint8_t* stored,
+		const uint8_t* digest, uint32_t part_size) {
+
+	/* the first mismatch is reported in full */
+	if (!result->bad_parts) {
+		result->status = VERIFY_BAD_PART;
+		result->first_bad_part = part;
+		result->first_bad_address = PART_STARTING_ADDRESS + (uint32_t)part * part_size;
+		memcpy(result->expected, stored, HASH_SIZE);
+		memcpy(result->computed, digest, HASH_SIZE);
+	}
+
+	/* every mismatch is counted and marked in the map */
+	result->bad_parts++;
+	if (part < VERIFY_MAP_PARTS)
+		result->bad_part_map[part >> 3] |= 1 << (part & 0x07);
+
+	return result->scan_all;
+}
+
+/**
+* Check the preamble and footer of the archive, and select the digest its parts
+* are hashed with
+*
+* @param result		Verification report
+* @param part_size	Size of a single part
+* @param no_parts	Number of parts in the archive
+*
+* @return preamble and footer are valid or are not valid
+*/
+uint8_t check_header(verify_result* result, uint32_t part_size, uint16_t no_parts) {
+	uint32_t start;
+
+	PROFILE_BEGIN(start);
+	if (get_preamble() != VALID_PREAMBLE)
+		result->status = VERIFY_BAD_PREAMBLE;
+	else if (!digest_backend_of(get_digest_algorithm()) || get_digest_algorithm() != verify_required_digest)
+		result->status = VERIFY_BAD_LAYOUT;
+	else if (get_footer(part_size, no_parts) != VALID_FOOTER)
+		result->status = VERIFY_BAD_FOOTER;
+	else
+		digest_select((e_digest_algorithm) get_digest_algorithm());
+	PROFILE_END(PROFILE_HEADER, start);
+
+	return result->status == VERIFY_OK;
+}
+
+/**
+* Pick up where an interrupted verification left off, when checkpoints are enabled
+*
+* @param result		Verification report, the resumed part is recorded in it
+* @param no_parts	Number of parts in the archive
+* @param part_size	Size of a single part
+*
+* @return index of the first part to verify
+*/
+uint16_t checkpoint_begin(verify_result* result, uint16_t no_parts, uint32_t part_size) {
+	uint16_t first_part = 0;
+
+	hashes_tracked = checkpoint_interval || verify_cache;
+	if (checkpoint_interval)
+		first_part = checkpoint_resume(no_parts, part_size, &checkpoint_hashes);
+	else
+		MD5_Init(&checkpoint_hashes);
+	result->resumed_part = first_part;
+	checkpoint_last = first_part;
+	checkpoint_written = first_part != 0;
+	return first_part;
+}
+
+/**
+* Check whether a checkpoint is due. Progress is only persisted while every part
+* so far has matched, so a resumed scan cannot lose a bad part.
+*
+* @param result		Verification report
+* @param next_part	Parts [0, next_part) have been verified
+*
+* @return due or not due
+*/
+uint8_t checkpoint_due(verify_result* result, uint16_t next_part) {
+	return checkpoint_interval && result->status == VERIFY_OK &&
+			(uint16_t)(next_part - checkpoint_last) >= checkpoint_interval;
+}
+
+/**
+* Persist a checkpoint
+*
+* @param next_part	Parts [0, next_part) have been verified
+*/
+void checkpoint_write(uint16_t next_part) {
+	if (checkpoint_save(next_part, &checkpoint_hashes) == CMD_SUCCESS) {
+		checkpoint_last = next_part;
+		checkpoint_written = 1;
+	}
+}
+
+/**
+* Close the checkpoint once the whole archive has verified, so the next boot
+* verifies from the start instead of resuming, or cache the archive as valid
+* (which closes the checkpoint as well)
+*
+* @param result		Verification report
+* @param no_parts	Number of parts in the archive
+*/
+void checkpoint_finish(verify_result* result, uint16_t no_parts) {
+	if (result->status == VERIFY_OK) {
+		if (verify_cache)
+			verify_cache_store(no_parts, &checkpoint_hashes);
+		else if (checkpoint_written)
+			checkpoint_write(no_parts);
+	}
+	checkpoint_written = 0;
+}
+
+/**
+* Persist a checkpoint in the middle of the ring: stop refilling, let the blocks
+* in flight land, then program the record with the DMA idle and its interrupt masked
+*
+* @param next_part	Parts [0, next_part) have been verified
+*/
+void ring_checkpoint(uint16_t next_part) {
+	dma_hold = 1;
+	while (blocks_requested != blocks_transferred && !dma_error) CPU_RELAX();
+
+	NVIC_DisableIRQ(DMA_IRQn);
+	if (!dma_error) checkpoint_write(next_part);
+	dma_hold = 0;
+	DMA_refill_ring();
+	NVIC_EnableIRQ(DMA_IRQn);
+}
+
+/**
+* Enable or disable the verified-archive cache. Once an archive verifies valid,
+* later verifies of the same header and stored hashes skip the payload.
+*
+* @param enabled	Use and update the cache
+*/
+void verify_set_cache(uint8_t enabled) {
+	verify_cache = enabled;
+}
+
+/**
+* Select the digest an archive must be hashed with. An archive whose header names
+* another digest does not verify, so a header cannot downgrade it.
+*
+* @param algorithm	One of the DIGEST_* values
+*/
+void verify_set_required_digest(uint8_t algorithm) {
+	verify_required_digest = algorithm;
+}
+
+/**
+* Get the digest an archive must be hashed with
+*
+* @return one of the DIGEST_* values
+*/
+uint8_t verify_get_required_digest() {
+	return verify_required_digest;
+}
+
+/**
+* Check the archive against the verified-archive cache
+*
+* @param result		Verification report, marked cached on a hit
+*
+* @return archive is cached as valid or is not
+*/
+uint8_t verify_cached(verify_result* result) {
+	uint16_t no_parts = get_number_of_parts();
+	uint32_t part_size = get_part_size();
+
+	if (!archive_fits(part_size, no_parts, 0)) return 0;
+	if (!check_header(result, part_size, no_parts)) {
+		result->status = VERIFY_OK;
+		return 0;
+	}
+
+	result->cached = verify_cache_lookup(no_parts, part_size);
+	return result->cached;
+}
+
+/**
+* Select how often verify persists its progress
+*
+* @param parts		Parts verified between checkpoints, 0 disables checkpoints
+*/
+void verify_set_checkpoint_interval(uint16_t parts) {
+	checkpoint_interval = parts;
+}
+
+/**
+* Get how often verify persists its progress
+*
+* @return parts verified between checkpoints, 0 if disabled
+*/
+uint16_t verify_get_checkpoint_interval() {
+	return checkpoint_interval;
 }
 
 /**
@@ -197,28 +769,37 @@ void transfer_to_RAM(uint8_t* src_addr, uint8_t* dest_addr, uint16_t* parts_to_t
 * @param block_capacity		Number of parts a block can store
 * @param parts_to_verify	Number of parts left to verify
 * @param part_size			Size of a single part
+* @param first_part			Index of the first part of the block in the archive
+* @param result				Verification report, mismatches are recorded in it
 *
-* @return hashes are correct or hashes are not correct
+* @return continue verifying or stop (a mismatch outside scan all mode)
 */
 uint8_t verify_block(uint8_t* block_addr, uint16_t* block_capacity,
-		uint16_t* parts_to_verify, uint32_t* part_size) {
+		uint16_t* parts_to_verify, uint32_t* part_size, uint16_t first_part,
+		verify_result* result) {
 
 	/* declare and initialize auxiliary variables */
 	uint16_t i;
-	uint8_t hash_of_part[16];
+	uint8_t digest[HASH_SIZE];
 	uint16_t needed_verifications = (*parts_to_verify < *block_capacity)? (*parts_to_verify) : (*block_capacity);
+	uint32_t start;
+	uint8_t match;
 
 	/* verify all parts in the block */
 	for (i=0; i<needed_verifications; i++) {
 
-		/* save the given hash of the part */
-		memcpy(hash_of_part, block_addr, HASH_SIZE);
+		/* calculate the correct hash of the part, leaving the stored one in place */
+		PROFILE_BEGIN(start);
+		calculate_part_hash(block_addr, *part_size - HASH_SIZE, digest);
+		PROFILE_END(PROFILE_HASH, start);
 
-		/* calculate the correct hash of the part */
-		calculate_part_hash(block_addr, *part_size - HASH_SIZE);
-
-		/* compare the given hash with the correct hash */
-		if (memcmp(hash_of_part, block_addr, HASH_SIZE)) return 0;
+		/* compare the stored hash with the correct hash */
+		PROFILE_BEGIN(start);
+		match = !memcmp(digest, block_addr, HASH_SIZE);
+		PROFILE_END(PROFILE_COMPARE, start);
+		if (!match && !record_bad_part(result, first_part + i, block_addr, digest, *part_size))
+			return 0;
+		if (hashes_tracked) MD5_Update(&checkpoint_hashes, block_addr, HASH_SIZE);
 		block_addr += *part_size;
 	}
 
@@ -228,63 +809,267 @@ uint8_t verify_block(uint8_t* block_addr, uint16_t* block_capacity,
 }
 
 /**
-* Verify the archive
+* Verify the archive through the DMA ring. The payload is streamed into a ring
+* of DMA_RING_DEPTH RAM blocks according to the DMA policy; the interrupt handler
+* marks landed blocks and keeps the ring filled while this loop hashes blocks at
+* the consumer index. With checkpoints enabled it resumes after the parts an
+* interrupted run already verified.
+*
+* @param result		Verification report (status and scan_all set up by the caller)
+*
+* @return archive is valid or archive is not valid
 */
-uint8_t verify() {
+uint8_t verify_ring(verify_result* result) {
 
 	/* declaration of needed variables */
-	uint16_t no_parts, parts_to_verify, parts_to_transfer, block_capacity;
-	uint32_t part_size;
+	uint16_t no_parts, parts_to_verify, block_capacity, no_blocks, first_part;
+	uint32_t part_size, block_bytes, last_block_bytes, start;
+	uint8_t slot;
+
+	/* initialization of variables */
+	part_size = get_part_size();
+	no_parts = get_number_of_parts();
+	if (part_size > RAM_BLOCK_SIZE || !archive_fits(part_size, no_parts, 0)) {
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
+	first_part = checkpoint_begin(result, no_parts, part_size);
+	parts_to_verify = no_parts - first_part;
+	block_capacity = RAM_BLOCK_SIZE / part_size;
+	block_bytes = block_capacity * part_size;
+	no_blocks = (parts_to_verify + block_capacity - 1) / block_capacity;
+	last_block_bytes = (parts_to_verify - (no_blocks - 1) * block_capacity) * part_size;
+
+	/* initialize the DMA controller and describe the payload left to verify */
+	DMA_init();
+	if (!DMA_build_chain(PART_STARTING_ADDRESS + (uint32_t)first_part * part_size,
+			no_blocks, block_bytes, last_block_bytes)) {
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
+
+	/* start filling the ring while checking preamble and footer */
+	NVIC_DisableIRQ(DMA_IRQn);
+	DMA_refill_ring();
+	NVIC_EnableIRQ(DMA_IRQn);
+
+	if (!check_header(result, part_size, no_parts)) {
+		DMA_stop();
+		return 0;
+	}
+
+	/* verify blocks in payload order */
+	while (blocks_verified < no_blocks) {
+		slot = blocks_verified % DMA_RING_DEPTH;
+
+		/* wait for the next block to reach terminal count */
+		PROFILE_BEGIN(start);
+		while (!(slots_ready & (1 << slot)) && !dma_error) CPU_RELAX();
+		PROFILE_END(PROFILE_DMA_WAIT, start);
+
+		/* a failed transfer leaves nothing to verify */
+		if (dma_error) {
+			result->status = VERIFY_DMA_ERROR;
+			DMA_stop();
+			return 0;
+		}
+
+		/* verify block, stop at the first mismatch unless scanning everything */
+		if (!verify_block(DMA_RING_BLOCK(slot), &block_capacity, &parts_to_verify, &part_size,
+				first_part + blocks_verified * block_capacity, result)) {
+			DMA_stop();
+			return 0;
+		}
 
-	/* declare blocks where the parts are transfered to */
-	uint8_t block1[RAM_BLOCK_SIZE], block2[RAM_BLOCK_SIZE];
+		/* release the block so the controller can refill it */
+		PROFILE_BEGIN(start);
+		NVIC_DisableIRQ(DMA_IRQn);
+		slots_ready &= ~(1 << slot);
+		blocks_verified++;
+		DMA_refill_ring();
+		NVIC_EnableIRQ(DMA_IRQn);
+		PROFILE_END(PROFILE_REARM, start);
 
-	/* declare and initialize the address of the part that should be transfered next */
-	uint8_t* part_addr = PART_STARTING_ADDRESS;
+		/* persist progress between blocks */
+		if (parts_to_verify && checkpoint_due(result, no_parts - parts_to_verify))
+			ring_checkpoint(no_parts - parts_to_verify);
+	}
+
+	ring_active = 0;
+	checkpoint_finish(result, no_parts);
+	return result->status == VERIFY_OK;
+}
 
-	/* declare and initialize a flag that indicates in which block to
-	 * store data from the DMA transfer and which block to verify */
-	uint8_t flag = 0;
+/**
+* Verify the archive in place. Parts are hashed straight from their flash
+* addresses through the flash accelerator's prefetch buffers, with no DMA setup
+* or RAM copies. With checkpoints enabled it resumes after the parts an
+* interrupted run already verified.
+*
+* @param result		Verification report (status and scan_all set up by the caller)
+*
+* @return archive is valid or archive is not valid
+*/
+uint8_t verify_flash(verify_result* result) {
+
+	/* declaration of needed variables */
+	uint16_t no_parts, i;
+	uint32_t part_size, start;
+	uint8_t digest[HASH_SIZE];
+	uint8_t* part_addr;
+	uint8_t match;
 
 	/* initialization of variables */
 	part_size = get_part_size();
-	block_capacity = RAM_BLOCK_SIZE / part_size;
 	no_parts = get_number_of_parts();
-	parts_to_verify = parts_to_transfer = no_parts;
+	if (!archive_fits(part_size, no_parts, 0)) {
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
 
-	/* initialize the DMA controller */
-	DMA_init();
+	if (!check_header(result, part_size, no_parts)) return 0;
+
+	/* hash every part at its flash address and compare with the stored hash */
+	i = checkpoint_begin(result, no_parts, part_size);
+	part_addr = PART_STARTING_ADDRESS + (uint32_t)i * part_size;
+	for (; i<no_parts; i++) {
+		PROFILE_BEGIN(start);
+		calculate_part_hash(part_addr, part_size - HASH_SIZE, digest);
+		PROFILE_END(PROFILE_HASH, start);
+
+		PROFILE_BEGIN(start);
+		match = !memcmp(digest, part_addr, HASH_SIZE);
+		PROFILE_END(PROFILE_COMPARE, start);
+		if (!match && !record_bad_part(result, i, part_addr, digest, part_size)) return 0;
+		if (hashes_tracked) MD5_Update(&checkpoint_hashes, part_addr, HASH_SIZE);
+		part_addr += part_size;
+
+		/* persist progress, nothing else reads flash meanwhile */
+		if (i + 1 < no_parts && checkpoint_due(result, i + 1))
+			checkpoint_write(i + 1);
+	}
+
+	checkpoint_finish(result, no_parts);
+	return result->status == VERIFY_OK;
+}
+
+/**
+* Select the engine verify uses
+*
+* @param engine		One of the VERIFY_ENGINE_* values
+*/
+void verify_set_engine(e_verify_engine engine) {
+	verify_engine = engine;
+}
+
+/**
+* Get the engine verify uses
+*
+* @return the current VERIFY_ENGINE_* value
+*/
+e_verify_engine verify_get_engine() {
+	return verify_engine;
+}
 
-	/* initial DMA transfer done while checking preamble and footer */
-	transfer_to_RAM(part_addr, block1, &parts_to_transfer, &block_capacity, &part_size);
+/**
+* Get cycles per byte in hundredths
+*
+* @param cycles		Cycles spent
+* @param bytes		Bytes processed
+*
+* @return cycles per byte multiplied by 100
+*/
+uint32_t cycles_per_byte_x100(uint32_t cycles, uint32_t bytes) {
+	return (bytes)? (uint32_t)(((uint64_t)cycles * 100) / bytes) : 0;
+}
 
-	/* check preamble and footer */
-	if (get_preamble() != VALID_PREAMBLE) return 0;
-	if (get_footer(part_size, no_parts) != VALID_FOOTER) return 0;
+/**
+* Run both engines over the archive and report their cycles per byte
+*
+* @param result		Where the validity and timing of both engines are stored
+*/
+void verify_benchmark(verify_benchmark_result* result) {
+	verify_result report;
+	uint32_t start;
 
-	/* wait for the transfer to finish */
-	while(!transfer_finished);
+	timer_init();
+	result->bytes = (uint32_t)get_number_of_parts() * get_part_size();
 
-	/* verify parts until all are verified (parts_to_verify != 0) */
-	while (parts_to_verify){
+	verify_result_init(&report, 0);
+	start = timer_cycles();
+	result->dma_valid = verify_ring(&report);
+	result->dma_cycles = timer_cycles() - start;
 
-		/* wait for the transfer to finish */
-		while(!transfer_finished);
+	verify_result_init(&report, 0);
+	start = timer_cycles();
+	result->flash_valid = verify_flash(&report);
+	result->flash_cycles = timer_cycles() - start;
 
-		/* increment the pointer of the part that should be transfered next */
-		part_addr += RAM_BLOCK_SIZE;
+	result->dma_cycles_per_byte_x100 = cycles_per_byte_x100(result->dma_cycles, result->bytes);
+	result->flash_cycles_per_byte_x100 = cycles_per_byte_x100(result->flash_cycles, result->bytes);
+}
 
-		/* start DMA transfer to block not being verified */
-		if (parts_to_transfer)
-			transfer_to_RAM(part_addr, (flag)? block1 : block2, &parts_to_transfer, &block_capacity, &part_size);
+/**
+* Prepare a verification report
+*
+* @param result		Report to clear
+* @param scan_all	Continue past mismatching parts and map all of them
+*/
+void verify_result_init(verify_result* result, uint8_t scan_all) {
+	memset(result, 0, sizeof(*result));
+	result->status = VERIFY_OK;
+	result->scan_all = scan_all;
+}
 
-		/* verify block while transferring, if verification is not correct return 0 */
-		if (!verify_block((!flag)? block1 : block2, &block_capacity, &parts_to_verify, &part_size)) return 0;
+/**
+* Get the label of a verification outcome
+*
+* @param status		Outcome
+*
+* @return the label, "unknown" for a value outside e_verify_status
+*/
+const char* verify_status_name(e_verify_status status) {
+	static const char* const names[] = {
+		"valid", "bad layout", "bad preamble", "bad footer", "DMA error", "bad part", "bad tree", "truncated"
+	};
 
-		/* invert flag (change which block to verify and which block to transfer to */
-		flag ^= 1;
-	}
+	return ((unsigned) status < sizeof(names) / sizeof(names[0]))? names[status] : "unknown";
+}
 
-	/* if loop finishes (all parts successfully verified) return 1 */
-	return 1;
+/**
+* Verify the archive with the selected engine and report where it is corrupted,
+* collecting per-phase cycle counts in verify_profile
+*
+* @param result		Where the report is stored
+* @param scan_all	Continue past mismatching parts and map all of them
+*
+* @return archive is valid or archive is not valid
+*/
+uint8_t verify_report(verify_result* result, uint8_t scan_all) {
+	uint32_t start;
+	uint8_t valid, use_flash;
+
+	use_flash = verify_engine == VERIFY_ENGINE_FLASH ||
+			(verify_engine == VERIFY_ENGINE_AUTO && get_part_size() <= VERIFY_FLASH_MAX_PART_SIZE);
+
+	verify_result_init(result, scan_all);
+	profiler_reset();
+	PROFILE_BEGIN(start);
+	if (verify_cache && verify_cached(result))
+		valid = 1;
+	else
+		valid = (use_flash)? verify_flash(result) : verify_ring(result);
+	PROFILE_END(PROFILE_VERIFY, start);
+
+	return valid;
+}
+
+/**
+* Verify the archive, stopping at the first mismatch
+*
+* @return archive is valid or archive is not valid
+*/
+uint8_t verify() {
+	verify_result result;
+	return verify_report(&result, 0);
 }
@@ -0,0 +1,139 @@
+/*
+ * benchmark.c
+ *
+ * Throughput of verify for the part size, RAM block size and archive length this
+ * image was built with, printed as a table row (over semihosting or a retargeted
+ * UART on the board, stdout on the host), and of every digest backend.
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "payload_generator.h"
+#include "definitions.h"
+#include "profiler.h"
+#include "benchmark.h"
+#include "digest.h"
+
+/* labels of the engine and policy columns */
+static const char* const engine_names[] = { "dma", "flash", "auto" };
+static const char* const policy_names[] = { "single", "linked", "striped" };
+
+/**
+* Run verify a number of times and work out its throughput
+*
+* @param row		Where the measurements are stored
+* @param rounds		Number of verify runs
+*
+* @return archive is valid in every round or is not valid
+*/
+uint8_t benchmark_run(benchmark_row* row, uint8_t rounds) {
+	uint8_t round;
+	uint64_t bytes;
+
+	memset(row, 0, sizeof(*row));
+	row->valid = 1;
+	row->part_size = get_part_size();
+	row->parts = get_number_of_parts();
+	row->block_size = RAM_BLOCK_SIZE;
+
+	/* verify resets the profile, collect it after every run */
+	for (round=0; round<rounds; round++) {
+		row->valid &= verify();
+		row->cycles += verify_profile[PROFILE_VERIFY].total;
+		row->idle_cycles += verify_profile[PROFILE_DMA_IDLE].total;
+	}
+
+	bytes = (uint64_t)row->part_size * row->parts * rounds;
+	if (row->cycles) {
+		row->bytes_per_second = (uint32_t)(bytes * SystemCoreClock / row->cycles);
+		row->dma_idle_x10 = (uint32_t)(row->idle_cycles * 1000 / row->cycles);
+	}
+	if (row->parts && rounds)
+		row->cycles_per_part = (uint32_t)(row->cycles / ((uint64_t)row->parts * rounds));
+
+	return row->valid;
+}
+
+/**
+* Print the column names of the benchmark table
+*/
+void benchmark_print_header() {
+	printf("part_size block_size parts  engine         bytes/s  cycles/part  dma_idle%%  valid\n");
+}
+
+/**
+* Print a benchmark table row
+*
+* @param row		Measurements of benchmark_run
+*/
+void benchmark_print_row(const benchmark_row* row) {
+	printf("%9u %10u %5u  %-5s %-7s %10u %12u  %6u.%u  %s\n",
+			(unsigned) row->part_size, (unsigned) row->block_size, (unsigned) row->parts,
+			engine_names[verify_get_engine()],
+			(verify_get_engine() == VERIFY_ENGINE_DMA)? policy_names[DMA_get_policy()] : "-",
+			(unsigned) row->bytes_per_second, (unsigned) row->cycles_per_part,
+			(unsigned) (row->dma_idle_x10 / 10), (unsigned) (row->dma_idle_x10 % 10),
+			(row->valid)? "yes" : "no");
+}
+
+/**
+* Print the benchmark table: a row for every DMA policy and one for the flash engine
+*
+* @param print_header	Print the column names first (off when appending to a sweep)
+*
+* @return archive is valid in every run or is not valid
+*/
+uint8_t benchmark_table(uint8_t print_header) {
+	benchmark_row row;
+	e_dma_policy policy;
+	uint8_t valid = 1;
+
+	if (print_header) benchmark_print_header();
+	verify_set_engine(VERIFY_ENGINE_DMA);
+	for (policy=DMA_POLICY_SINGLE; policy<=DMA_POLICY_STRIPED; policy++) {
+		DMA_set_policy(policy);
+		valid &= benchmark_run(&row, BENCHMARK_ROUNDS);
+		benchmark_print_row(&row);
+	}
+	verify_set_engine(VERIFY_ENGINE_FLASH);
+	valid &= benchmark_run(&row, BENCHMARK_ROUNDS);
+	benchmark_print_row(&row);
+
+	return valid;
+}
+
+/**
+* Print the throughput of every digest backend over the parts of the archive in
+* flash, as calculate_part_hash hashes them
+*
+* @param rounds		Passes over the archive per backend
+*/
+void benchmark_digests(uint8_t rounds) {
+	const digest_backend* backend;
+	uint8_t digest[HASH_SIZE], algorithm, round;
+	uint32_t part_size = get_part_size(), start;
+	uint16_t no_parts = get_number_of_parts(), i;
+	uint64_t cycles, bytes;
+
+	if (part_size <= HASH_SIZE) return;
+	printf("digest      bytes/s  cycles/KB\n");
+	for (algorithm=0; algorithm<DIGEST_ALGORITHMS; algorithm++) {
+		backend = digest_backend_of(algorithm);
+		cycles = 0;
+		for (round=0; round<rounds; round++) {
+			start = timer_cycles();
+			for (i=0; i<no_parts; i++)
+				backend->digest(PART_STARTING_ADDRESS + (uint32_t)i * part_size + HASH_SIZE,
+						part_size - HASH_SIZE, digest);
+			cycles += (uint32_t)(timer_cycles() - start);
+		}
+
+		bytes = (uint64_t)(part_size - HASH_SIZE) * no_parts * rounds;
+		printf("%-7s %11u %10u\n", backend->name,
+				(unsigned) ((cycles)? bytes * SystemCoreClock / cycles : 0),
+				(unsigned) ((bytes)? cycles * 1024 / bytes : 0));
+	}
+}
@@ -58,6 +58,11 @@
 typedef unsigned int (*IAP)(unsigned int[], unsigned int[]);
 static const IAP iap_entry = (IAP) IAP_ADDRESS;
 
+/*
+* Status of the last copy started with iap_copy_ram_to_flash_start
+*/
+static int copy_status = CMD_SUCCESS;
+
 /*---------------------------------------------------------------------------
 * Public functions
 */
@@ -146,3 +151,171 @@ int iap_copy_ram_to_flash(void* ram_address, void* flash_address, e_iap_size cou
 
     return (int) result[0];
 }
+
+/**
+* Copy RAM contents into flash, to be finished with iap_wait. The ROM routine
+* holds the core until the write is done, so on the LPC17xx the copy completes
+* here and iap_wait only returns its status.
+*
+* @param ram_address    RAM address to be copied
+*                       It should be in word boundary
+* @param flash_address  Flash address where the contents are to be copied
+*                       It should be within 256bytes boundary
+* @param count          Number of data to be copied (in bytes)
+*                       The options: 256, 512, 1024, 4096
+*
+* @return CMD_SUCCESS, the status of the copy is returned by iap_wait
+*/
+int iap_copy_ram_to_flash_start(void* ram_address, void* flash_address, e_iap_size count)
+{
+    copy_status = iap_copy_ram_to_flash(ram_address, flash_address, count);
+
+    return CMD_SUCCESS;
+}
+
+/**
+* Wait for the copy started by iap_copy_ram_to_flash_start
+*
+* @return the status of the copy, as iap_copy_ram_to_flash returns it
+*/
+int iap_wait(void)
+{
+    return copy_status;
+}
+
+/**
+* Compare flash contents with RAM
+*
+* @param flash_address  Flash address of the data to compare
+*                       It should be in word boundary
+* @param ram_address    RAM address of the data to compare
+*                       It should be in word boundary
+* @param count          Number of bytes to compare, a multiple of 4
+* @param offset         Where the offset of the first mismatching word is
+*                       stored on COMPARE_ERROR (may be NULL)
+*
+* @return CMD_SUCCESS, COMPARE_ERROR, COUNT_ERROR or an address error
+*/
+int iap_compare(void* flash_address, void* ram_address, unsigned int count, unsigned int* offset)
+{
+    unsigned int command[5];
+    unsigned int result[4];
+
+    command[0] = COMPARE;
+    command[1] = (unsigned int) flash_address;
+    command[2] = (unsigned int) ram_address;
+    command[3] = count;
+    iap_entry(command, result);
+
+    if (result[0] == COMPARE_ERROR && offset)
+        *offset = result[1];
+
+    return (int) result[0];
+}
+
+/**
+* Blank check flash sector(s)
+*
+* @param sector_start  The start of the sector to be checked
+* @param sector_end    The end of the sector to be checked
+* @param offset        Where the offset of the first non-blank word is stored
+*                      on SECTOR_NOT_BLANK (may be NULL)
+* @param contents      Where that word is stored (may be NULL)
+*
+* @return CMD_SUCCESS, BUSY, SECTOR_NOT_BLANK or INVALID_SECTOR
+*/
+int iap_blank_check_sector(unsigned int sector_start, unsigned int sector_end,
+        unsigned int* offset, unsigned int* contents)
+{
+    unsigned int command[5];
+    unsigned int result[4];
+
+    command[0] = BLANK_CHECK_SECTOR;
+    command[1] = (unsigned int) sector_start;
+    command[2] = (unsigned int) sector_end;
+    iap_entry(command, result);
+
+    if (result[0] == SECTOR_NOT_BLANK) {
+        if (offset)
+            *offset = result[1];
+        if (contents)
+            *contents = result[2];
+    }
+
+    return (int) result[0];
+}
+
+/**
+* Read the part identification number
+*
+* @param part_id       Where the part ID is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_part_id(unsigned int* part_id)
+{
+    unsigned int command[5];
+    unsigned int result[4];
+
+    command[0] = READ_PART_ID;
+    iap_entry(command, result);
+    *part_id = result[1];
+
+    return (int) result[0];
+}
+
+/**
+* Read the boot code version number
+*
+* @param major         Where the major version is stored
+* @param minor         Where the minor version is stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_boot_code_version(unsigned char* major, unsigned char* minor)
+{
+    unsigned int command[5];
+    unsigned int result[4];
+
+    command[0] = READ_BOOT_CODE_REV;
+    iap_entry(command, result);
+    *major = (unsigned char) (result[1] >> 8);
+    *minor = (unsigned char) result[1];
+
+    return (int) result[0];
+}
+
+/**
+* Read the device serial number
+*
+* @param uid           Where the four words of the serial number are stored
+*
+* @return CMD_SUCCESS
+*/
+int iap_read_uid(unsigned int uid[4])
+{
+    unsigned int command[5];
+    unsigned int result[5];
+
+    command[0] = READ_UID;
+    iap_entry(command, result);
+    uid[0] = result[1];
+    uid[1] = result[2];
+    uid[2] = result[3];
+    uid[3] = result[4];
+
+    return (int) result[0];
+}
+
+/**
+* Invoke the ISP bootloader, as if the device was reset with the ISP pin low.
+* Does not return.
+*/
+void iap_reinvoke_isp(void)
+{
+    unsigned int command[5];
+    unsigned int result[4];
+
+    command[0] = REINVOKE_ISP;
+    iap_entry(command, result);
+}
@@ -18,6 +18,32 @@
 #include "payload_generator.h"
 #include "leds.h"
 #include "definitions.h"
+#include "profiler.h"
+#include "benchmark.h"
+#include "digest.h"
+
+/* print a throughput table row of every engine and DMA policy over semihosting
+ * instead of running the LED demo (rebuild with other PAYLOAD_SIZE_BYTES,
+ * RAM_BLOCK_SIZE and FLASH_USER_PAYLOAD_END_SECTOR values to sweep them) */
+//#define VERIFY_BENCHMARK 1
+
+/* persist verification progress every this many parts, so a brown-out resumes
+ * instead of starting again from part 0 (0 disables checkpoints) */
+#define CHECKPOINT_INTERVAL 0
+
+/* skip re-hashing the payload on boots where the archive is the one last verified
+ * valid (only its header and stored hashes are read) */
+#define VERIFY_CACHE 1
+
+/* install the archive in one pass: every block is validated before it is
+ * programmed and read back with the IAP compare command, so the archive does not
+ * have to be re-read and verified afterwards */
+//#define VERIFY_INSTALL 1
+
+/* digest the archive is written with and must be hashed with to verify:
+ * DIGEST_MD5, DIGEST_CRC32 to only catch corruption at the lowest cost, or
+ * DIGEST_SHA256 (an archive whose header names another digest is rejected) */
+#define VERIFY_DIGEST DIGEST_MD5
 
 /**
 * delay of approximately 1 second
@@ -33,37 +59,49 @@ void delay(){
 */
 int main(void) {
     e_iap_status iap_status;
+#ifndef VERIFY_INSTALL
+    verify_result result;
+#endif
     int flag;
-    double elapsed;
 
+#ifdef VERIFY_INSTALL
+    generator_set_install(1);
+#endif
+    generator_set_digest(VERIFY_DIGEST);
     iap_status = (e_iap_status) generator_init();
     if (iap_status != CMD_SUCCESS) {
         while(1);   // Error !!!
     }
 
-    /* set up a timer */  /*
-	LPC_SC->PCONP |= 1 << 2; // Power up Timer 1
-	LPC_SC->PCLKSEL0 |= 0x01 << 4; // CCLK
-	LPC_TIM1->PR = 0xffffffff;
-	LPC_TIM1->TCR |= 1 << 1; // Manually reset Timer 1 (forced)
-	LPC_TIM1->TCR &= ~(1 << 1); // Stop resetting the timer
-	LPC_TIM1->MCR = 0x00;
-	LPC_TIM1->TCR |= 1 << 0; // Start T1
-	uint64_t start = LPC_TIM1->TC * 0xffffffff + LPC_TIM1->PC; // Start  */
+	/* pick the fastest DMA burst sizes for this board's flash timing (swept on the
+	 * first boot only, the winner is kept in the log sector) */
+	DMA_autotune();
+	verify_set_checkpoint_interval(CHECKPOINT_INTERVAL);
+	verify_set_cache(VERIFY_CACHE);
+	verify_set_required_digest(VERIFY_DIGEST);
+
+#ifdef VERIFY_BENCHMARK
+	benchmark_table(1);
+	benchmark_digests(BENCHMARK_ROUNDS);
+	while(1);
+#endif
 
 	/* set testing pin to 1 */
 	LPC_GPIO2->FIODIR = (1 << 13);
 	LPC_GPIO2->FIOSET = (1 << 13);
 
-	/* verify the archive */
-    flag = verify();
+	/* verify the archive, mapping every bad part so only those need re-flashing
+	 * (per-phase cycle counts are left in verify_profile) */
+#ifdef VERIFY_INSTALL
+    /* every block was validated and read back while it was programmed */
+    flag = 1;
+#else
+    flag = verify_report(&result, 1);
+#endif
 
     /* set testing pin to 0 */
     LPC_GPIO2->FIOCLR = (1 << 13);
 
-    /* measure time until here */
-    //uint64_t end = LPC_TIM1->TC * 0xffffffff + LPC_TIM1->PC; // End
-
     /* initialize led and turn it off by default */
     led2_init();
     led2_off();
@@ -54,6 +54,19 @@
 #define H2(x, y, z)			((x) ^ ((y) ^ (z)))
 #define I(x, y, z)			((y) ^ ((x) | ~(z)))
 
+/*
+ * Cortex-M3 message loads.  The M3 is little-endian and executes unaligned
+ * LDR in hardware, so message words are loaded straight from the input
+ * instead of being assembled byte by byte into ctx->block.  It is the
+ * default when building for ARMv7-M; define MD5_PORTABLE_KERNEL to use the
+ * reference code instead, or define MD5_CM3_KERNEL on a little-endian host
+ * to check it bit-exactly.
+ */
+#if defined(__ARM_ARCH_7M__) && !defined(MD5_PORTABLE_KERNEL) && \
+	!defined(MD5_CM3_KERNEL)
+#define MD5_CM3_KERNEL
+#endif
+
 /*
  * The MD5 transformation for all four rounds.
  */
@@ -70,7 +83,15 @@
  * memory accesses is just an optimization.  Nothing will break if it
  * doesn't work.
  */
-#if defined(__i386__) || defined(__x86_64__) || defined(__vax__)
+#if defined(MD5_CM3_KERNEL)
+typedef struct {
+	MD5_u32plus word;
+} __attribute__((packed, may_alias)) MD5_unaligned_u32;
+#define SET(n) \
+	(((const MD5_unaligned_u32 *)ptr)[(n)].word)
+#define GET(n) \
+	SET(n)
+#elif defined(__i386__) || defined(__x86_64__) || defined(__vax__)
 #define SET(n) \
 	(*(MD5_u32plus *)&ptr[(n) * 4])
 #define GET(n) \
@@ -293,4 +314,304 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx)
 	memset(ctx, 0, sizeof(*ctx));
 }
 
+/*
+ * One-shot digest of a contiguous message.  Whole 64-byte blocks are
+ * compressed straight from the input, and only the final padded block(s)
+ * are built on the stack, so nothing is staged through ctx->buffer the
+ * way MD5_Update does.  result may point anywhere outside the input.
+ */
+void MD5_Digest(const void *data, unsigned long size, unsigned char *result)
+{
+	MD5_CTX ctx;
+	unsigned char *tail = ctx.buffer;
+	unsigned long used;
+
+	MD5_Init(&ctx);
+
+	if (size >= 64)
+		data = body(&ctx, data, size & ~(unsigned long)0x3f);
+
+	used = size & 0x3f;
+	memcpy(tail, data, used);
+	tail[used++] = 0x80;
+
+	if (used > 56) {
+		memset(&tail[used], 0, 64 - used);
+		body(&ctx, tail, 64);
+		used = 0;
+	}
+
+	memset(&tail[used], 0, 56 - used);
+
+	tail[56] = size << 3;
+	tail[57] = size >> 5;
+	tail[58] = size >> 13;
+	tail[59] = size >> 21;
+	tail[60] = (size >> 29) & 0xff;
+	tail[61] = tail[62] = tail[63] = 0;
+
+	body(&ctx, tail, 64);
+
+	result[0] = ctx.a;
+	result[1] = ctx.a >> 8;
+	result[2] = ctx.a >> 16;
+	result[3] = ctx.a >> 24;
+	result[4] = ctx.b;
+	result[5] = ctx.b >> 8;
+	result[6] = ctx.b >> 16;
+	result[7] = ctx.b >> 24;
+	result[8] = ctx.c;
+	result[9] = ctx.c >> 8;
+	result[10] = ctx.c >> 16;
+	result[11] = ctx.c >> 24;
+	result[12] = ctx.d;
+	result[13] = ctx.d >> 8;
+	result[14] = ctx.d >> 16;
+	result[15] = ctx.d >> 24;
+}
+
+/*
+ * Multi-buffer hashing of equal-sized messages.  MD5 is serial within a
+ * message, but the parts of an archive are independent, so an x86 host runs
+ * one message per 32-bit lane of a vector register: 4 lanes with SSE2, 8
+ * with AVX2 and 16 with AVX-512.  The widest kernel the CPU supports is
+ * picked at start-up (MD5_x_N_select() narrows it); other targets, such as
+ * the Cortex-M3, hash one message after the other with MD5_Digest().
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	!defined(MD5_NO_MULTI_BUFFER)
+
+typedef void (*MD5_lanes_kernel)(MD5_u32plus *state,
+	const unsigned char **ptr, unsigned long blocks);
+
+/*
+ * A kernel compresses blocks of every lane at once.  state holds the a, b,
+ * c and d words of all lanes in turn, ptr the next block of each lane.  The
+ * message words are transposed so that word n of every lane forms a vector.
+ */
+#define MD5_LANES_KERNEL(name, lanes, isa) \
+typedef MD5_u32plus name##_vec __attribute__((vector_size((lanes) * 4))); \
+__attribute__((target(isa))) \
+static void name(MD5_u32plus *state, const unsigned char **ptr, \
+	unsigned long blocks) \
+{ \
+	name##_vec a, b, c, d, saved_a, saved_b, saved_c, saved_d, x[16]; \
+	MD5_u32plus words[16], lane; \
+	unsigned int n; \
+\
+	memcpy(&a, &state[0 * (lanes)], sizeof(a)); \
+	memcpy(&b, &state[1 * (lanes)], sizeof(b)); \
+	memcpy(&c, &state[2 * (lanes)], sizeof(c)); \
+	memcpy(&d, &state[3 * (lanes)], sizeof(d)); \
+\
+	while (blocks--) { \
+		for (lane = 0; lane < (lanes); lane++) { \
+			memcpy(words, ptr[lane], 64); \
+			for (n = 0; n < 16; n++) \
+				x[n][lane] = words[n]; \
+			ptr[lane] += 64; \
+		} \
+\
+		saved_a = a; \
+		saved_b = b; \
+		saved_c = c; \
+		saved_d = d; \
+\
+		STEP(F, a, b, c, d, x[0], 0xd76aa478, 7) \
+		STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12) \
+		STEP(F, c, d, a, b, x[2], 0x242070db, 17) \
+		STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22) \
+		STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7) \
+		STEP(F, d, a, b, c, x[5], 0x4787c62a, 12) \
+		STEP(F, c, d, a, b, x[6], 0xa8304613, 17) \
+		STEP(F, b, c, d, a, x[7], 0xfd469501, 22) \
+		STEP(F, a, b, c, d, x[8], 0x698098d8, 7) \
+		STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12) \
+		STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17) \
+		STEP(F, b, c, d, a, x[11], 0x895cd7be, 22) \
+		STEP(F, a, b, c, d, x[12], 0x6b901122, 7) \
+		STEP(F, d, a, b, c, x[13], 0xfd987193, 12) \
+		STEP(F, c, d, a, b, x[14], 0xa679438e, 17) \
+		STEP(F, b, c, d, a, x[15], 0x49b40821, 22) \
+\
+		STEP(G, a, b, c, d, x[1], 0xf61e2562, 5) \
+		STEP(G, d, a, b, c, x[6], 0xc040b340, 9) \
+		STEP(G, c, d, a, b, x[11], 0x265e5a51, 14) \
+		STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20) \
+		STEP(G, a, b, c, d, x[5], 0xd62f105d, 5) \
+		STEP(G, d, a, b, c, x[10], 0x02441453, 9) \
+		STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14) \
+		STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20) \
+		STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5) \
+		STEP(G, d, a, b, c, x[14], 0xc33707d6, 9) \
+		STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14) \
+		STEP(G, b, c, d, a, x[8], 0x455a14ed, 20) \
+		STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5) \
+		STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9) \
+		STEP(G, c, d, a, b, x[7], 0x676f02d9, 14) \
+		STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20) \
+\
+		STEP(H, a, b, c, d, x[5], 0xfffa3942, 4) \
+		STEP(H2, d, a, b, c, x[8], 0x8771f681, 11) \
+		STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16) \
+		STEP(H2, b, c, d, a, x[14], 0xfde5380c, 23) \
+		STEP(H, a, b, c, d, x[1], 0xa4beea44, 4) \
+		STEP(H2, d, a, b, c, x[4], 0x4bdecfa9, 11) \
+		STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16) \
+		STEP(H2, b, c, d, a, x[10], 0xbebfbc70, 23) \
+		STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4) \
+		STEP(H2, d, a, b, c, x[0], 0xeaa127fa, 11) \
+		STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16) \
+		STEP(H2, b, c, d, a, x[6], 0x04881d05, 23) \
+		STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4) \
+		STEP(H2, d, a, b, c, x[12], 0xe6db99e5, 11) \
+		STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16) \
+		STEP(H2, b, c, d, a, x[2], 0xc4ac5665, 23) \
+\
+		STEP(I, a, b, c, d, x[0], 0xf4292244, 6) \
+		STEP(I, d, a, b, c, x[7], 0x432aff97, 10) \
+		STEP(I, c, d, a, b, x[14], 0xab9423a7, 15) \
+		STEP(I, b, c, d, a, x[5], 0xfc93a039, 21) \
+		STEP(I, a, b, c, d, x[12], 0x655b59c3, 6) \
+		STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10) \
+		STEP(I, c, d, a, b, x[10], 0xffeff47d, 15) \
+		STEP(I, b, c, d, a, x[1], 0x85845dd1, 21) \
+		STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6) \
+		STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10) \
+		STEP(I, c, d, a, b, x[6], 0xa3014314, 15) \
+		STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21) \
+		STEP(I, a, b, c, d, x[4], 0xf7537e82, 6) \
+		STEP(I, d, a, b, c, x[11], 0xbd3af235, 10) \
+		STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15) \
+		STEP(I, b, c, d, a, x[9], 0xeb86d391, 21) \
+\
+		a += saved_a; \
+		b += saved_b; \
+		c += saved_c; \
+		d += saved_d; \
+	} \
+\
+	memcpy(&state[0 * (lanes)], &a, sizeof(a)); \
+	memcpy(&state[1 * (lanes)], &b, sizeof(b)); \
+	memcpy(&state[2 * (lanes)], &c, sizeof(c)); \
+	memcpy(&state[3 * (lanes)], &d, sizeof(d)); \
+}
+
+MD5_LANES_KERNEL(MD5_lanes_sse2, 4, "sse2")
+MD5_LANES_KERNEL(MD5_lanes_avx2, 8, "avx2")
+MD5_LANES_KERNEL(MD5_lanes_avx512, 16, "avx512f")
+
+static MD5_lanes_kernel MD5_kernel;
+static unsigned int MD5_kernel_lanes = 1;
+
+unsigned int MD5_x_N_select(unsigned int max_lanes)
+{
+	__builtin_cpu_init();
+
+	MD5_kernel = 0;
+	MD5_kernel_lanes = 1;
+	if (max_lanes >= 16 && __builtin_cpu_supports("avx512f")) {
+		MD5_kernel = MD5_lanes_avx512;
+		MD5_kernel_lanes = 16;
+	} else if (max_lanes >= 8 && __builtin_cpu_supports("avx2")) {
+		MD5_kernel = MD5_lanes_avx2;
+		MD5_kernel_lanes = 8;
+	} else if (max_lanes >= 4 && __builtin_cpu_supports("sse2")) {
+		MD5_kernel = MD5_lanes_sse2;
+		MD5_kernel_lanes = 4;
+	}
+
+	return MD5_kernel_lanes;
+}
+
+__attribute__((constructor))
+static void MD5_x_N_init(void)
+{
+	MD5_x_N_select(MD5_MAX_LANES);
+}
+
+/*
+ * Hashes n messages of size bytes each: data[i] is hashed into results[i].
+ * Messages are taken a kernel's worth of lanes at a time; the lanes left
+ * over in the last group repeat the first message and are discarded.
+ */
+void MD5_x_N(const void *const *data, unsigned long size,
+	unsigned char *const *results, unsigned int n)
+{
+	const unsigned char *ptr[MD5_MAX_LANES];
+	unsigned char tail[MD5_MAX_LANES][128];
+	MD5_u32plus state[4 * MD5_MAX_LANES], word;
+	unsigned int lanes = MD5_kernel_lanes, count, lane, i;
+	unsigned long used, blocks;
+
+	while (n) {
+		count = (n < lanes) ? n : lanes;
+		if (count == 1) {
+			MD5_Digest(data[0], size, results[0]);
+			data++;
+			results++;
+			n--;
+			continue;
+		}
+
+		for (lane = 0; lane < lanes; lane++) {
+			ptr[lane] = (const unsigned char *)data[(lane < count) ? lane : 0];
+			state[0 * lanes + lane] = 0x67452301;
+			state[1 * lanes + lane] = 0xefcdab89;
+			state[2 * lanes + lane] = 0x98badcfe;
+			state[3 * lanes + lane] = 0x10325476;
+		}
+
+		if (size >= 64)
+			MD5_kernel(state, ptr, size >> 6);
+
+		/* the padded final block(s), as MD5_Digest builds them */
+		used = size & 0x3f;
+		blocks = (used >= 56) ? 2 : 1;
+		for (lane = 0; lane < lanes; lane++) {
+			memcpy(tail[lane], ptr[lane], used);
+			tail[lane][used] = 0x80;
+			memset(&tail[lane][used + 1], 0, blocks * 64 - 8 - used - 1);
+			tail[lane][blocks * 64 - 8] = size << 3;
+			tail[lane][blocks * 64 - 7] = size >> 5;
+			tail[lane][blocks * 64 - 6] = size >> 13;
+			tail[lane][blocks * 64 - 5] = size >> 21;
+			tail[lane][blocks * 64 - 4] = (size >> 29) & 0xff;
+			tail[lane][blocks * 64 - 3] = 0;
+			tail[lane][blocks * 64 - 2] = 0;
+			tail[lane][blocks * 64 - 1] = 0;
+			ptr[lane] = tail[lane];
+		}
+		MD5_kernel(state, ptr, blocks);
+
+		for (lane = 0; lane < count; lane++)
+			for (i = 0; i < 16; i++) {
+				word = state[(i >> 2) * lanes + lane];
+				results[lane][i] = word >> ((i & 3) * 8);
+			}
+
+		data += count;
+		results += count;
+		n -= count;
+	}
+}
+
+#else
+
+unsigned int MD5_x_N_select(unsigned int max_lanes)
+{
+	(void)max_lanes;
+
+	return 1;
+}
+
+void MD5_x_N(const void *const *data, unsigned long size,
+	unsigned char *const *results, unsigned int n)
+{
+	while (n--)
+		MD5_Digest(*data++, size, *results++);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,188 @@
+/*
+ * merkle.c
+ *
+ * Merkle tree variant of the archive: a single part or a range of parts can be
+ * verified against the root in the header with O(log n) node hashes, without
+ * reading the rest of the payload.
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <string.h>
+#include "md5.h"
+#include "payload_generator.h"
+#include "definitions.h"
+#include "merkle.h"
+#include "digest.h"
+
+/**
+* Work out the shape of the tree over an archive
+*
+* @param tree		Where the layout is stored
+* @param no_parts	Number of parts (leaves)
+* @param part_size	Size of a single part
+*/
+void merkle_layout(merkle_tree* tree, uint16_t no_parts, uint32_t part_size) {
+	uint8_t level = 0;
+
+	tree->no_parts = no_parts;
+	tree->part_size = part_size;
+	tree->nodes_offset = PART_STARTING_OFFSET + (uint32_t)no_parts * part_size + ARCHIVE_FOOTER_SIZE;
+	tree->nodes_count = 0;
+	tree->size[0] = no_parts;
+	tree->first[0] = 0;
+
+	/* every level halves the one below it, rounding up */
+	while (tree->size[level] > 1) {
+		tree->size[level + 1] = (tree->size[level] + 1) / 2;
+		tree->first[level + 1] = tree->nodes_count;
+		tree->nodes_count += tree->size[level + 1];
+		level++;
+	}
+	tree->levels = level + 1;
+}
+
+/**
+* Get the flash offset of a node
+*
+* @param tree		Tree layout
+* @param level		Level of the node, 0 for the leaves
+* @param index		Index of the node in its level
+*
+* @return offset of the node (a leaf is the hash stored in front of its part)
+*/
+uint32_t merkle_node_offset(const merkle_tree* tree, uint8_t level, uint16_t index) {
+	if (!level) return PART_STARTING_OFFSET + (uint32_t)index * tree->part_size;
+	return tree->nodes_offset + (tree->first[level] + index) * HASH_SIZE;
+}
+
+/**
+* Calculate a parent node
+*
+* @param left		Left child
+* @param right		Right child, 0 when the left child is the last node of an odd level
+* @param parent		Where the parent is stored (may be one of the children)
+*/
+void merkle_combine(const uint8_t* left, const uint8_t* right, uint8_t* parent) {
+	uint8_t pair[2 * HASH_SIZE];
+
+	if (!right) {
+		memmove(parent, left, HASH_SIZE);
+		return;
+	}
+	memcpy(pair, left, HASH_SIZE);
+	memcpy(&pair[HASH_SIZE], right, HASH_SIZE);
+	digest_selected()->digest(pair, sizeof(pair), parent);
+}
+
+/**
+* Check whether the archive carries a Merkle tree
+*
+* @return Merkle archive or flat archive
+*/
+uint8_t archive_is_merkle() {
+	return (HEADER_ADDRESS[ARCHIVE_FLAGS_OFFSET] & ARCHIVE_FLAG_MERKLE) != 0;
+}
+
+/**
+* Verify a range of parts against the root in the header. The data of every part
+* is hashed and compared with its leaf, the stored nodes above the range are
+* recomputed level by level until a single node covers it, and that node is taken
+* to the root with its stored siblings.
+*
+* @param first_part		Index of the first part
+* @param count			Number of parts
+* @param result			Verification report
+*
+* @return range is valid or range is not valid
+*/
+uint8_t archive_verify_range(uint16_t first_part, uint16_t count, verify_result* result) {
+	merkle_tree tree;
+	uint16_t no_parts, lo, hi, i, sibling;
+	uint32_t part_size;
+	uint8_t level, node[HASH_SIZE], digest[HASH_SIZE];
+	const uint8_t* part_addr;
+	const uint8_t* right;
+
+	verify_result_init(result, 0);
+	part_size = get_part_size();
+	no_parts = get_number_of_parts();
+	merkle_layout(&tree, no_parts, part_size);
+
+	/* the parts, the footer and the nodes after it have to be inside the archive */
+	if (!count || (uint32_t)first_part + count > no_parts || !archive_is_merkle() ||
+			!archive_fits(part_size, no_parts, tree.nodes_count * HASH_SIZE) ||
+			!digest_backend_of(get_digest_algorithm()) || get_digest_algorithm() != verify_get_required_digest()) {
+		result->status = VERIFY_BAD_LAYOUT;
+		return 0;
+	}
+	if (get_preamble() != VALID_PREAMBLE) {
+		result->status = VERIFY_BAD_PREAMBLE;
+		return 0;
+	}
+	if (get_footer(part_size, no_parts) != VALID_FOOTER) {
+		result->status = VERIFY_BAD_FOOTER;
+		return 0;
+	}
+	digest_select((e_digest_algorithm) get_digest_algorithm());
+
+	/* the data of every part must match its leaf */
+	part_addr = PART_STARTING_ADDRESS + (uint32_t)first_part * part_size;
+	for (i=0; i<count; i++) {
+		calculate_part_hash(part_addr, part_size - HASH_SIZE, digest);
+		if (memcmp(digest, part_addr, HASH_SIZE)) {
+			record_bad_part(result, first_part + i, part_addr, digest, part_size);
+			return 0;
+		}
+		part_addr += part_size;
+	}
+
+	/* the stored nodes above the range must be the parents of the nodes below them */
+	lo = first_part;
+	hi = first_part + count - 1;
+	for (level=0; lo != hi; level++) {
+		for (i=lo>>1; i<=(hi>>1); i++) {
+			right = (2 * i + 1 < tree.size[level])?
+					FLASH_ADDRESS(merkle_node_offset(&tree, level, 2 * i + 1)) : 0;
+			merkle_combine(FLASH_ADDRESS(merkle_node_offset(&tree, level, 2 * i)), right, node);
+			if (memcmp(node, FLASH_ADDRESS(merkle_node_offset(&tree, level + 1, i)), HASH_SIZE)) {
+				result->status = VERIFY_BAD_TREE;
+				return 0;
+			}
+		}
+		lo >>= 1;
+		hi >>= 1;
+	}
+
+	/* take the node covering the range to the root */
+	memcpy(node, FLASH_ADDRESS(merkle_node_offset(&tree, level, lo)), HASH_SIZE);
+	for (; level<tree.levels - 1; level++) {
+		sibling = lo ^ 1;
+		if (sibling < tree.size[level]) {
+			if (lo & 1)
+				merkle_combine(FLASH_ADDRESS(merkle_node_offset(&tree, level, sibling)), node, node);
+			else
+				merkle_combine(node, FLASH_ADDRESS(merkle_node_offset(&tree, level, sibling)), node);
+		}
+		lo >>= 1;
+	}
+
+	if (memcmp(node, HEADER_ADDRESS + ARCHIVE_ROOT_OFFSET, HASH_SIZE)) {
+		result->status = VERIFY_BAD_TREE;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+* Verify a single part against the root in the header
+*
+* @param part		Index of the part
+* @param result		Verification report
+*
+* @return part is valid or part is not valid
+*/
+uint8_t archive_verify_part(uint16_t part, verify_result* result) {
+	return archive_verify_range(part, 1, result);
+}
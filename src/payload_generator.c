@@ -14,6 +14,9 @@
 #include "iap_driver.h"
 #include "md5.h"
 #include "payload_generator.h"
+#include "definitions.h"
+#include "merkle.h"
+#include "digest.h"
 
 //#define WRONG_HASH 1
 
@@ -23,39 +26,338 @@ uint8_t wrong_hashes_chunk_positions[NUMBER_OF_WRONG_HASHES] = { 3, 8, 11, 15 };
 uint8_t wrong_hashes_current_position = 0;
 #endif
 
+/* start address of every flash sector, indexed by sector number */
+const unsigned int sector_start_address[] = {
+    (unsigned int) FLASH_SECTOR_0_ADDRESS,
+    (unsigned int) FLASH_SECTOR_1_ADDRESS,
+    (unsigned int) FLASH_SECTOR_2_ADDRESS,
+    (unsigned int) FLASH_SECTOR_3_ADDRESS,
+    (unsigned int) FLASH_SECTOR_4_ADDRESS,
+    (unsigned int) FLASH_SECTOR_5_ADDRESS,
+    (unsigned int) FLASH_SECTOR_6_ADDRESS,
+    (unsigned int) FLASH_SECTOR_7_ADDRESS,
+    (unsigned int) FLASH_SECTOR_8_ADDRESS,
+    (unsigned int) FLASH_SECTOR_9_ADDRESS,
+    (unsigned int) FLASH_SECTOR_10_ADDRESS,
+    (unsigned int) FLASH_SECTOR_11_ADDRESS,
+    (unsigned int) FLASH_SECTOR_12_ADDRESS,
+    (unsigned int) FLASH_SECTOR_13_ADDRESS,
+    (unsigned int) FLASH_SECTOR_14_ADDRESS,
+    (unsigned int) FLASH_SECTOR_15_ADDRESS,
+    (unsigned int) FLASH_SECTOR_16_ADDRESS,
+    (unsigned int) FLASH_SECTOR_17_ADDRESS,
+    (unsigned int) FLASH_SECTOR_18_ADDRESS,
+    (unsigned int) FLASH_SECTOR_19_ADDRESS,
+    (unsigned int) FLASH_SECTOR_20_ADDRESS,
+    (unsigned int) FLASH_SECTOR_21_ADDRESS,
+    (unsigned int) FLASH_SECTOR_22_ADDRESS,
+    (unsigned int) FLASH_SECTOR_23_ADDRESS,
+    (unsigned int) FLASH_SECTOR_24_ADDRESS,
+    (unsigned int) FLASH_SECTOR_25_ADDRESS,
+    (unsigned int) FLASH_SECTOR_26_ADDRESS,
+    (unsigned int) FLASH_SECTOR_27_ADDRESS,
+    (unsigned int) FLASH_SECTOR_28_ADDRESS,
+    (unsigned int) FLASH_SECTOR_29_ADDRESS
+};
+
+/* archive format written by generator_init, and the Merkle root of the last tree written */
+static uint8_t merkle_format = 0;
+static uint8_t merkle_root[MD5_HASH_SIZE_BYTES];
+
+/* install mode: every block is validated before it is programmed and compared
+   with flash afterwards; flash offset of the first fault found, if any */
+static uint8_t install_mode = 0;
+static uint32_t install_fault = GENERATOR_NO_FAULT;
+
+/* delta mode: only sectors holding parts whose hashes changed are re-flashed;
+   payload sectors erased and programmed by the last generator_init */
+static uint8_t delta_mode = 0;
+static uint16_t sectors_written = 0;
+
+/* blocks of the payload pipeline: one is filled and hashed while the other is
+   being programmed (words, IAP copies from word boundaries) */
+static uint32_t payload_blocks[2][FLASH_BLOCK_SIZE_4K / sizeof(uint32_t)];
+
+/* generator of the random payload data */
+static e_payload_prng payload_prng = PAYLOAD_PRNG_DEFAULT;
+
+/* called as write_payload programs every block */
+static generator_progress progress_callback = 0;
+
+/* digest the part hashes and Merkle nodes are calculated with */
+static uint8_t payload_digest = DIGEST_MD5;
+
+/**
+* Select whether generator_init writes the Merkle tree variant of the archive
+*
+* @param enabled    Write a tree after the footer and its root in the header
+*/
+void generator_set_merkle(uint8_t enabled)
+{
+    merkle_format = enabled;
+}
+
+/**
+* Select whether generator_init installs the archive, validating every 4K block
+* before it is programmed and comparing flash with it afterwards
+*
+* @param enabled    Validate and read back every block
+*/
+void generator_set_install(uint8_t enabled)
+{
+    install_mode = enabled;
+}
+
+/**
+* Get where the last install found a fault
+*
+* @return flash offset of the first bad part or mismatching word,
+*         GENERATOR_NO_FAULT if none was found
+*/
+uint32_t generator_get_fault(void)
+{
+    return install_fault;
+}
+
+/**
+* Select whether generator_init updates an archive of the same layout in place,
+* re-flashing only the sectors holding parts whose hashes changed
+*
+* @param enabled    Compare the new part hashes with those in flash first
+*/
+void generator_set_delta(uint8_t enabled)
+{
+    delta_mode = enabled;
+}
+
+/**
+* Get the number of payload sectors the last generator_init erased and programmed
+*
+* @return sectors written
+*/
+uint16_t generator_sectors_written(void)
+{
+    return sectors_written;
+}
+
+/**
+* Select the generator of the random payload data
+*
+* @param prng           PAYLOAD_PRNG_XORSHIFT, or PAYLOAD_PRNG_NEWLIB to
+*                       reproduce images of older builds
+*/
+void generator_set_prng(e_payload_prng prng)
+{
+    payload_prng = prng;
+}
+
+/**
+* Set the function write_payload reports its progress to
+*
+* @param callback       Called after every block is programmed, 0 for none
+*/
+void generator_set_progress(generator_progress callback)
+{
+    progress_callback = callback;
+}
+
+/**
+* Select the digest generator_init hashes the parts with and names in the header
+*
+* @param algorithm      DIGEST_MD5, DIGEST_CRC32 or DIGEST_SHA256
+*/
+void generator_set_digest(uint8_t algorithm)
+{
+    if (digest_backend_of(algorithm))
+        payload_digest = algorithm;
+}
+
+/**
+* Get the sector holding a flash address
+*
+* @param address        Flash address
+*
+* @return the sector number
+*/
+static unsigned int sector_of(uint32_t address)
+{
+    if (address < FLASH_SECTOR_16_ADDRESS)
+        return address / FLASH_BLOCK_SIZE_4K;
+    return FLASH_SECTOR_16 + (address - FLASH_SECTOR_16_ADDRESS) / FLASH_BLOCK_SIZE_32K;
+}
+
+/**
+* Get the number of parts of the archive written by the generator
+*
+* @return number of parts
+*/
+static uint16_t archive_parts(void)
+{
+    return ((sector_start_address[FLASH_USER_END_SECTOR] - sector_start_address[FLASH_USER_PAYLOAD_START_SECTOR]) / FLASH_BLOCK_SIZE_4K) * PAYLOAD_BLOCK_PIECES;
+}
+
+/**
+* Start programming a 4K block to flash
+*
+* @param block          Block to write, left untouched until program_finish
+* @param address        Flash address of the block
+* @param sector         Sector holding the address
+*
+* @return IAP status codes
+*/
+static int program_start(uint8_t block[], uint32_t address, unsigned int sector)
+{
+    e_iap_status iap_status;
+
+    /* Prepare the sector for writing */
+    iap_status = (e_iap_status) iap_prepare_sector(sector, sector);
+    if (iap_status != CMD_SUCCESS)
+        return iap_status;
+
+    /* Start writing the block to flash */
+    return iap_copy_ram_to_flash_start(block, (void *)(uintptr_t)address, SIZE_4096);
+}
+
+/**
+* Wait for a block to be programmed, comparing flash with it afterwards in install
+* and delta mode
+*
+* @param block          Block being written
+* @param address        Flash address of the block
+*
+* @return IAP status codes
+*/
+static int program_finish(uint8_t block[], uint32_t address)
+{
+    e_iap_status iap_status;
+    unsigned int offset;
+
+    iap_status = (e_iap_status) iap_wait();
+    if (iap_status != CMD_SUCCESS || !(install_mode || delta_mode))
+        return iap_status;
+
+    /* Read it back, a programming fault is caught at the sector it happens in */
+    iap_status = (e_iap_status) iap_compare((void *)(uintptr_t)address, block, SIZE_4096, &offset);
+    if (iap_status == COMPARE_ERROR)
+        install_fault = address + offset;
+
+    return iap_status;
+}
+
+/**
+* Program a 4K block to flash, comparing flash with it afterwards in install and
+* delta mode
+*
+* @param block          Block to write
+* @param address        Flash address of the block
+* @param sector         Sector holding the address
+*
+* @return IAP status codes
+*/
+static int program_block(uint8_t block[], uint32_t address, unsigned int sector)
+{
+    e_iap_status iap_status;
+
+    iap_status = (e_iap_status) program_start(block, address, sector);
+    if (iap_status != CMD_SUCCESS)
+        return iap_status;
+
+    return program_finish(block, address);
+}
+
+/**
+* Check the stored hash of every part of a payload block before it is programmed
+*
+* @param block          Block of PAYLOAD_BLOCK_PIECES parts
+* @param address        Flash address of the block
+*
+* @return CMD_SUCCESS, or COMPARE_ERROR if a part does not match its hash
+*/
+static int validate_block(const uint8_t block[], uint32_t address)
+{
+    uint8_t digest[MD5_HASH_SIZE_BYTES];
+    int payload_piece;
+
+    for (payload_piece = 0; payload_piece < PAYLOAD_BLOCK_PIECES; ++payload_piece) {
+        digest_backend_of(payload_digest)->digest(&block[payload_piece * PAYLOAD_BLOCK_SIZE + MD5_HASH_SIZE_BYTES],
+                PAYLOAD_SIZE_BYTES, digest);
+        if (memcmp(digest, &block[payload_piece * PAYLOAD_BLOCK_SIZE], MD5_HASH_SIZE_BYTES)) {
+            install_fault = address + payload_piece * PAYLOAD_BLOCK_SIZE;
+            return COMPARE_ERROR;
+        }
+    }
+
+    return CMD_SUCCESS;
+}
+
+/**
+* Derive the generator state of a part from its seed (seed scheme
+* PAYLOAD_SEED_VERSION): the seed and the version are mixed with the MurmurHash3
+* finalizer, so neighbouring seeds start far apart and the state is never zero
+*
+* @param seed       Seed of the part
+*
+* @return the initial xorshift state
+*/
+static uint32_t payload_state(uint32_t seed)
+{
+    uint32_t state = seed + PAYLOAD_SEED_VERSION * 0x9E3779B9UL;
+
+    state ^= state >> 16;
+    state *= 0x85EBCA6BUL;
+    state ^= state >> 13;
+    state *= 0xC2B2AE35UL;
+    state ^= state >> 16;
+
+    return (state)? state : 0x9E3779B9UL;
+}
+
 /**
 * Initialize given payload with random data
 */
 void seed_payload(uint8_t payload[], uint32_t size, int seed)
 {
     int i;
+    uint32_t state, word;
 
-    /* Seed the random number generator */
-    srand(seed);
+    /* Newlib's rand, one byte per call, reproduces images of older builds */
+    if (payload_prng == PAYLOAD_PRNG_NEWLIB) {
 
-    /* Generate random values for the payload */
-    for (i = 0; i < size; ++i)
-        payload[i] = rand() % 256;
+        /* Seed the random number generator */
+        srand(seed);
+
+        /* Generate random values for the payload */
+        for (i = 0; i < size; ++i)
+            payload[i] = rand() % 256;
+        return;
+    }
+
+    /* xorshift32, a word per step, stored little-endian */
+    state = payload_state(seed);
+    for (i = 0; i < size; i += sizeof(word)) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        word = state;
+
+        if (size - i >= sizeof(word))
+            memcpy(&payload[i], &word, sizeof(word));
+        else
+            memcpy(&payload[i], &word, size - i);
+    }
 }
 
 /**
-* Calculate MD5 hash for a given payload
+* Calculate the hash of a given payload with the selected digest
 */
 void calculate_hash(uint8_t* hash_destination, uint32_t data_size)
 {
 #ifdef WRONG_HASH
     int i;
 #endif
-    MD5_CTX ctx;
-
-    /* Initialize the MD5 context */
-    MD5_Init(&ctx);
 
-    /* Calculate MD5 hash with iterative calculation */
-    MD5_Update(&ctx, &hash_destination[MD5_HASH_SIZE_BYTES], data_size);
-
-    /* Place the hash in the payload block */
-    MD5_Final(hash_destination, &ctx);
+    /* Calculate the hash of the data and place it in the payload block */
+    digest_backend_of(payload_digest)->digest(&hash_destination[MD5_HASH_SIZE_BYTES], data_size, hash_destination);
 
 #ifdef WRONG_HASH
     for (i = 0; i < NUMBER_OF_WRONG_HASHES; ++i)
@@ -67,103 +369,391 @@ void calculate_hash(uint8_t* hash_destination, uint32_t data_size)
 }
 
 /**
-* Write to flash the start block
+* Fill a 4K block with the parts stored at a flash address: random data seeded
+* from the address of every part, preceded by its hash
+*
+* @param block          Block to fill
+* @param address        Flash address of the block
+*/
+static void build_block(uint8_t block[], uint32_t address)
+{
+    int index;
+    int payload_piece;
+
+    for (payload_piece = 0; payload_piece < PAYLOAD_BLOCK_PIECES; ++payload_piece) {
+
+#ifdef WRONG_HASH
+        ++wrong_hashes_current_position;
+#endif
+
+        /* Calculate the start address of the sub-sector */
+        index = payload_piece * PAYLOAD_BLOCK_SIZE;
+
+        /* Initialize it with random data */
+        seed_payload(&block[index + MD5_HASH_SIZE_BYTES], PAYLOAD_SIZE_BYTES, address + payload_piece);
+
+        /* Calculate the hash of the random data */
+        calculate_hash(&block[index], PAYLOAD_SIZE_BYTES);
+    }
+}
+
+/**
+* Program a payload block, checking its parts first when installing
+*
+* @param block          Block of PAYLOAD_BLOCK_PIECES parts
+* @param address        Flash address of the block
+* @param sector         Sector holding the address
 *
 * @return IAP status codes
 */
-int write_header(void)
+static int write_block(uint8_t block[], uint32_t address, unsigned int sector)
 {
     e_iap_status iap_status;
-    uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
+
+    /* Check the block before it is programmed when installing */
+    if (install_mode) {
+        iap_status = (e_iap_status) validate_block(block, address);
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+    }
+
+    return program_block(block, address, sector);
+}
+
+/**
+* Account for a programmed payload block and report the progress
+*
+* @param address        Flash address of the block
+* @param start          Flash address of the payload
+* @param end            Flash address right after the payload
+*/
+static void payload_progress(uint32_t address, uint32_t start, uint32_t end)
+{
+    address += FLASH_BLOCK_SIZE_4K;
+
+    /* The block completed a sector */
+    if (address == sector_start_address[sector_of(address - 1) + 1])
+        ++sectors_written;
+
+    if (progress_callback)
+        progress_callback(address - start, end - start);
+}
+
+/**
+* Fill in the fields of a header block
+*
+* @param block          Header block, zero except for the fields
+* @param chunks         Number of parts
+* @param size           Size of a part, its hash included
+* @param root           Merkle root of a tree archive, 0 for a flat archive
+* @param algorithm      Digest of the part hashes (e_digest_algorithm)
+*/
+void build_header(uint8_t block[], uint16_t chunks, uint32_t size, const uint8_t* root, uint8_t algorithm)
+{
     uint16_t header;
-    uint16_t chunks;
-    uint32_t size;
 
     /* Preamble */
     header = FLASH_USER_HEADER_BLOCK_DATA;
     memcpy(&block[0], &header, sizeof(header));
 
     /* Number of chunks */
-    chunks = ((FLASH_USER_SECTORS_4K - 1) * PAYLOAD_BLOCK_PIECES) + ((FLASH_USER_SECTORS_32K - 1) * PAYLOAD_BLOCK_PIECES * PAYLOAD_BLOCK_PIECES_32K);
     memcpy(&block[2], &chunks, sizeof(chunks));
 
     /* Size of chunks */
-    size = PAYLOAD_BLOCK_SIZE;
     memcpy(&block[4], &size, sizeof(size));
 
-    /* Prepare the current sector for writing */
-    iap_status = (e_iap_status) iap_prepare_sector(FLASH_USER_HEADER_SECTOR, FLASH_USER_HEADER_SECTOR);
-    if (iap_status != CMD_SUCCESS)
-        return iap_status;
+    /* Format flags and the root of the tree */
+    if (root) {
+        block[ARCHIVE_FLAGS_OFFSET] = ARCHIVE_FLAG_MERKLE;
+        memcpy(&block[ARCHIVE_ROOT_OFFSET], root, MD5_HASH_SIZE_BYTES);
+    }
 
-    /* Write payload block to flash */
-    iap_status = (e_iap_status) iap_copy_ram_to_flash(&block, (void *)sector_start_address[FLASH_USER_HEADER_SECTOR], SIZE_4096);
-    if (iap_status != CMD_SUCCESS)
-        return iap_status;
+    /* Digest of the parts and the tree */
+    block[ARCHIVE_DIGEST_OFFSET] = algorithm;
+}
 
-    return iap_status;
+/**
+* Write to flash the start block
+*
+* @return IAP status codes
+*/
+int write_header(void)
+{
+    e_iap_status iap_status;
+    uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
+
+    /* The root is that of the tree written by write_end */
+    build_header(block, archive_parts(), PAYLOAD_BLOCK_SIZE, (merkle_format)? merkle_root : 0, payload_digest);
+
+    /* An update leaves an unchanged header alone and erases a changed one first */
+    if (delta_mode) {
+        if (!memcmp(block, FLASH_ADDRESS(sector_start_address[FLASH_USER_HEADER_SECTOR]), FLASH_BLOCK_SIZE_4K))
+            return CMD_SUCCESS;
+
+        iap_status = (e_iap_status) erase_sectors(FLASH_USER_HEADER_SECTOR, FLASH_USER_HEADER_SECTOR);
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+    }
+
+    /* Write header block to flash */
+    return program_block(block, sector_start_address[FLASH_USER_HEADER_SECTOR], FLASH_USER_HEADER_SECTOR);
 }
 
 /**
-* Write to flash the payload blocks
+* Write to flash the payload blocks. Blocks are pipelined through two RAM
+* buffers: the next block is seeded and hashed while the previous one is
+* being programmed.
 *
 * @return IAP status codes
 */
 int write_payload(void)
 {
-    e_iap_status iap_status;
-    int index;
+    e_iap_status iap_status, valid;
+    uint32_t start = sector_start_address[FLASH_USER_PAYLOAD_START_SECTOR];
+    uint32_t end = sector_start_address[FLASH_USER_END_SECTOR];
+    uint32_t address;
+    uint8_t* block;
+    uint8_t* previous = 0;
+
+    for (address = start; address < end; address += FLASH_BLOCK_SIZE_4K) {
+        block = (uint8_t *) payload_blocks[((address - start) / FLASH_BLOCK_SIZE_4K) & 1];
+
+        /* Seed the payload and calculate its hash */
+        build_block(block, address);
+
+        /* Check the block before it is programmed when installing */
+        valid = (install_mode)? (e_iap_status) validate_block(block, address) : CMD_SUCCESS;
+
+        /* Retire the block programmed meanwhile */
+        if (previous) {
+            iap_status = (e_iap_status) program_finish(previous, address - FLASH_BLOCK_SIZE_4K);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
+            payload_progress(address - FLASH_BLOCK_SIZE_4K, start, end);
+        }
+        if (valid != CMD_SUCCESS)
+            return valid;
+
+        /* Start programming this block */
+        iap_status = (e_iap_status) program_start(block, address, sector_of(address));
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+        previous = block;
+    }
+
+    /* Retire the last block */
+    iap_status = (e_iap_status) program_finish(previous, end - FLASH_BLOCK_SIZE_4K);
+    if (iap_status == CMD_SUCCESS)
+        payload_progress(end - FLASH_BLOCK_SIZE_4K, start, end);
+
+    return iap_status;
+}
+
+/**
+* Check whether any part of a 4K block has a hash other than the one in flash
+*
+* @param block          Block of PAYLOAD_BLOCK_PIECES parts
+* @param address        Flash address of the block
+*
+* @return changed or unchanged
+*/
+static uint8_t block_changed(const uint8_t block[], uint32_t address)
+{
     int payload_piece;
-    int sub_blocks = 1;
-    int sector = FLASH_USER_PAYLOAD_START_SECTOR;
-    uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
-    uint32_t offset = FLASH_BLOCK_SIZE_4K;
-    uint32_t address = sector_start_address[FLASH_USER_PAYLOAD_START_SECTOR];
 
-    /* Seed the payload and calculate its hash */
-    while (sector <= FLASH_USER_PAYLOAD_END_SECTOR) {
+    /* Only the 16-byte hash in front of every part is read */
+    for (payload_piece = 0; payload_piece < PAYLOAD_BLOCK_PIECES; ++payload_piece)
+        if (memcmp(&block[payload_piece * PAYLOAD_BLOCK_SIZE],
+                FLASH_ADDRESS(address + payload_piece * PAYLOAD_BLOCK_SIZE), MD5_HASH_SIZE_BYTES))
+            return 1;
 
-        /* We need to populate several sub-sectors */
-        for (payload_piece = 0; payload_piece < PAYLOAD_BLOCK_PIECES; ++payload_piece) {
+    return 0;
+}
 
-#ifdef WRONG_HASH
-            ++wrong_hashes_current_position;
-#endif
+/**
+* Invalidate the archive in flash before an update changes it, by erasing the
+* header sector. An update interrupted after this point leaves no valid preamble,
+* so a half-updated archive is never taken for a valid one.
+*
+* @return IAP status codes
+*/
+static int invalidate_header(void)
+{
+    return erase_sectors(FLASH_USER_HEADER_SECTOR, FLASH_USER_HEADER_SECTOR);
+}
+
+/**
+* Update the payload blocks in place: a sector is erased and programmed only
+* when one of its parts has a hash other than the one stored in flash. The
+* header is invalidated before the first sector is erased. A 32K
+* sector is generated twice when it changed, once to compare and once to program,
+* which is still far cheaper than erasing and programming it.
+*
+* @return IAP status codes
+*/
+int write_payload_delta(void)
+{
+    e_iap_status iap_status;
+    unsigned int sector;
+    uint32_t address, blocks, changed, i;
+    uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
 
-            /* Calculate the start address of the sub-sector */
-            index = payload_piece * PAYLOAD_BLOCK_SIZE;
+    for (sector = FLASH_USER_PAYLOAD_START_SECTOR; sector <= FLASH_USER_PAYLOAD_END_SECTOR; ++sector) {
+        address = sector_start_address[sector];
+        blocks = (sector_start_address[sector + 1] - address) / FLASH_BLOCK_SIZE_4K;
 
-            /* Initialize it with random data */
-            seed_payload(&block[index + MD5_HASH_SIZE_BYTES], PAYLOAD_SIZE_BYTES, address + payload_piece);
+        /* Compare the new hashes of the sector with the stored ones */
+        for (i = 0, changed = 0; i < blocks && !changed; ++i) {
+            build_block(block, address + i * FLASH_BLOCK_SIZE_4K);
+            changed = block_changed(block, address + i * FLASH_BLOCK_SIZE_4K);
+        }
+        if (!changed)
+            continue;
 
-            /* Calculate the hash of the random data */
-            calculate_hash(&block[index], PAYLOAD_SIZE_BYTES);
+        if (!sectors_written) {
+            iap_status = (e_iap_status) invalidate_header();
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
         }
 
-        /* Prepare the current flash sector for writing */
         iap_status = (e_iap_status) iap_prepare_sector(sector, sector);
         if (iap_status != CMD_SUCCESS)
             return iap_status;
 
-        /* Write payload block to flash sector */
-        iap_status = (e_iap_status) iap_copy_ram_to_flash(&block, (void *)address, SIZE_4096);
+        iap_status = (e_iap_status) iap_erase_sector(sector, sector);
         if (iap_status != CMD_SUCCESS)
             return iap_status;
 
-        /* Increment flash address */
-        address += offset;
+        /* A 4K sector still holds its block, the blocks of a 32K one are built again */
+        for (i = 0; i < blocks; ++i) {
+            if (blocks > 1)
+                build_block(block, address + i * FLASH_BLOCK_SIZE_4K);
 
-        /* If we are currently in 32K flash block we need to populate */
-        /* several sub-blocks inside [PAYLOAD_BLOCK_PIECES_32K] */
-        if ((sector >= FLASH_SECTOR_16) && (sub_blocks < PAYLOAD_BLOCK_PIECES_32K)) {
-            ++sub_blocks;
-        } else {
-            sub_blocks = 1;
-            ++sector;
+            iap_status = (e_iap_status) write_block(block, address + i * FLASH_BLOCK_SIZE_4K, sector);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
         }
+        ++sectors_written;
     }
 
-    return iap_status;
+    return CMD_SUCCESS;
+}
+
+/**
+* Append data to the end section, writing every 4K block to flash once it is full
+*
+* @param block          Block being assembled
+* @param address        Flash address of the block
+* @param used           Bytes of the block assembled so far
+* @param data           Data to append
+* @param size           Size of the data
+*
+* @return IAP status codes
+*/
+static int end_append(uint8_t block[], uint32_t *address, uint32_t *used, const uint8_t *data, uint32_t size)
+{
+    e_iap_status iap_status;
+    uint32_t length;
+
+    while (size) {
+        length = FLASH_BLOCK_SIZE_4K - *used;
+        if (length > size)
+            length = size;
+        memcpy(&block[*used], data, length);
+        *used += length;
+        data += length;
+        size -= length;
+
+        if (*used == FLASH_BLOCK_SIZE_4K) {
+            iap_status = (e_iap_status) program_block(block, *address, FLASH_USER_END_SECTOR);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
+
+            *address += FLASH_BLOCK_SIZE_4K;
+            *used = 0;
+            memset(block, 0, FLASH_BLOCK_SIZE_4K);
+        }
+    }
+
+    return CMD_SUCCESS;
+}
+
+/**
+* Read a node of the end section, from flash or from the block still being
+* assembled (a node can straddle the two)
+*
+* @param node           Where the node is stored
+* @param offset         Flash offset of the node
+* @param block          Block being assembled
+* @param address        Flash address of the block
+*/
+static void end_read(uint8_t node[], uint32_t offset, const uint8_t block[], uint32_t address)
+{
+    uint32_t i;
+
+    for (i = 0; i < MD5_HASH_SIZE_BYTES; ++i, ++offset)
+        node[i] = (offset >= address)? block[offset - address] : *FLASH_ADDRESS(offset);
+}
+
+/**
+* Write to flash the end block followed by the Merkle tree over the stored hashes.
+* Nodes are written level by level; a parent reads its children back from flash,
+* or from the block still being assembled.
+*
+* @return IAP status codes
+*/
+int write_merkle_end(void)
+{
+    e_iap_status iap_status;
+    merkle_tree tree;
+    uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
+    uint8_t footer[ARCHIVE_FOOTER_SIZE];
+    uint8_t node[MD5_HASH_SIZE_BYTES];
+    uint8_t children[2][MD5_HASH_SIZE_BYTES];
+    uint32_t address = sector_start_address[FLASH_USER_END_SECTOR];
+    uint32_t used = 0;
+    uint16_t index;
+    uint8_t level;
+
+    merkle_layout(&tree, archive_parts(), PAYLOAD_BLOCK_SIZE);
+
+    /* Parents are hashed with the digest of the parts */
+    digest_select((e_digest_algorithm) payload_digest);
+
+    /* The tree has to fit the end sector */
+    if (ARCHIVE_FOOTER_SIZE + tree.nodes_count * MD5_HASH_SIZE_BYTES >
+            ((FLASH_USER_END_SECTOR >= FLASH_SECTOR_16)? FLASH_BLOCK_SIZE_32K : FLASH_BLOCK_SIZE_4K))
+        return COUNT_ERROR;
+
+    memset(footer, FLASH_USER_END_BLOCK_DATA, sizeof(footer));
+    iap_status = (e_iap_status) end_append(block, &address, &used, footer, sizeof(footer));
+    if (iap_status != CMD_SUCCESS)
+        return iap_status;
+
+    /* A single part is its own root */
+    memcpy(merkle_root, FLASH_ADDRESS(merkle_node_offset(&tree, 0, 0)), MD5_HASH_SIZE_BYTES);
+
+    for (level = 1; level < tree.levels; ++level)
+        for (index = 0; index < tree.size[level]; ++index) {
+            end_read(children[0], merkle_node_offset(&tree, level - 1, 2 * index), block, address);
+            if (2 * index + 1 < tree.size[level - 1]) {
+                end_read(children[1], merkle_node_offset(&tree, level - 1, 2 * index + 1), block, address);
+                merkle_combine(children[0], children[1], node);
+            }
+            else
+                merkle_combine(children[0], 0, node);
+            memcpy(merkle_root, node, MD5_HASH_SIZE_BYTES);
+
+            iap_status = (e_iap_status) end_append(block, &address, &used, node, MD5_HASH_SIZE_BYTES);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
+        }
+
+    /* Write what is left of the last block */
+    if (used)
+        return program_block(block, address, FLASH_USER_END_SECTOR);
+
+    return CMD_SUCCESS;
 }
 
 /**
@@ -174,27 +764,110 @@ int write_payload(void)
 int write_end(void)
 {
     uint32_t i;
-    e_iap_status iap_status;
     uint8_t block[FLASH_BLOCK_SIZE_4K] = { 0 };
 
+    if (merkle_format)
+        return write_merkle_end();
+
     for (i = 0; i < PAYLOAD_BLOCK_SIZE; ++i)
         block[i] = FLASH_USER_END_BLOCK_DATA;
 
-    /* Prepare the current sector for writing */
-    iap_status = (e_iap_status) iap_prepare_sector(FLASH_USER_END_SECTOR, FLASH_USER_END_SECTOR);
-    if (iap_status != CMD_SUCCESS)
-        return iap_status;
+    /* Write end block to flash */
+    return program_block(block, sector_start_address[FLASH_USER_END_SECTOR], FLASH_USER_END_SECTOR);
+}
+
+/**
+* Erase a range of sectors, skipping those that are already blank. Runs of
+* sectors that are not blank are prepared and erased together.
+*
+* @param sector_start   First sector of the range
+* @param sector_end     Last sector of the range
+*
+* @return IAP status codes
+*/
+int erase_sectors(unsigned int sector_start, unsigned int sector_end)
+{
+    e_iap_status iap_status;
+    unsigned int sector;
+    unsigned int first = sector_end + 1;
+    int blank;
+
+    /* One step past the range closes the last run */
+    for (sector = sector_start; sector <= sector_end + 1; ++sector) {
+        blank = 1;
+        if (sector <= sector_end) {
+            iap_status = (e_iap_status) iap_blank_check_sector(sector, sector, 0, 0);
+            if (iap_status != CMD_SUCCESS && iap_status != SECTOR_NOT_BLANK)
+                return iap_status;
+            blank = iap_status == CMD_SUCCESS;
+        }
+
+        /* A run of sectors to erase starts here */
+        if (!blank && first > sector_end) {
+            first = sector;
+            continue;
+        }
+
+        /* A run ends before a blank sector */
+        if (blank && first <= sector_end) {
+            iap_status = (e_iap_status) iap_prepare_sector(first, sector - 1);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
+
+            iap_status = (e_iap_status) iap_erase_sector(first, sector - 1);
+            if (iap_status != CMD_SUCCESS)
+                return iap_status;
+
+            first = sector_end + 1;
+        }
+    }
+
+    return CMD_SUCCESS;
+}
+
+/**
+* Update an archive of the same layout in place: only the payload sectors whose
+* part hashes changed are re-flashed, the end section only when the payload or
+* the format changed, and the header only when it differs. The header is erased
+* before anything else is, and every block is read back after it is programmed,
+* so the new header is written only once the rest of the archive is in flash.
+*
+* @return IAP status codes
+*/
+static int update_archive(void)
+{
+    e_iap_status iap_status;
 
-    /* Write payload block to flash */
-    iap_status = (e_iap_status) iap_copy_ram_to_flash(&block, (void *)sector_start_address[FLASH_USER_END_SECTOR], SIZE_4096);
+    /* Re-flash the changed payload sectors */
+    iap_status = (e_iap_status)write_payload_delta();
     if (iap_status != CMD_SUCCESS)
         return iap_status;
 
-    return iap_status;
+    /* The end section depends on the stored hashes and the format */
+    if (sectors_written || archive_is_merkle() != merkle_format ||
+            get_footer(PAYLOAD_BLOCK_SIZE, archive_parts()) != VALID_FOOTER) {
+        iap_status = (e_iap_status)invalidate_header();
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+
+        iap_status = (e_iap_status)erase_sectors(FLASH_USER_END_SECTOR, FLASH_USER_END_SECTOR);
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+
+        iap_status = (e_iap_status)write_end();
+        if (iap_status != CMD_SUCCESS)
+            return iap_status;
+    }
+    else if (merkle_format)
+        memcpy(merkle_root, HEADER_ADDRESS + ARCHIVE_ROOT_OFFSET, MD5_HASH_SIZE_BYTES);
+
+    /* Write header in flash last, it carries the Merkle root */
+    return write_header();
 }
 
 /**
-* Fill flash with the payload
+* Fill flash with the payload. In delta mode an archive of the same layout
+* already in flash is updated in place instead.
 *
 * @return IAP status codes
 */
@@ -204,19 +877,16 @@ int generator_init(void)
 
     /* Init the IAP driver */
     iap_init();
+    install_fault = GENERATOR_NO_FAULT;
+    sectors_written = 0;
 
-    /* Prepare the user sectors for erase */
-    iap_status = (e_iap_status) iap_prepare_sector(FLASH_USER_HEADER_SECTOR, FLASH_USER_END_SECTOR);
-    if (iap_status != CMD_SUCCESS)
-        return iap_status;
+    /* Parts hashed with another digest all differ, the update would rewrite everything */
+    if (delta_mode && get_preamble() == VALID_PREAMBLE && get_digest_algorithm() == payload_digest &&
+            get_number_of_parts() == archive_parts() && get_part_size() == PAYLOAD_BLOCK_SIZE)
+        return update_archive();
 
-    /* Erase all user sectors */
-    iap_status = (e_iap_status) iap_erase_sector(FLASH_USER_HEADER_SECTOR, FLASH_USER_END_SECTOR);
-    if (iap_status != CMD_SUCCESS)
-        return iap_status;
-
-    /* Write header in flash */
-    iap_status = (e_iap_status)write_header();
+    /* Erase the user sectors that are not blank already */
+    iap_status = (e_iap_status) erase_sectors(FLASH_USER_HEADER_SECTOR, FLASH_USER_END_SECTOR);
     if (iap_status != CMD_SUCCESS)
         return iap_status;
 
@@ -225,8 +895,14 @@ int generator_init(void)
     if (iap_status != CMD_SUCCESS)
         return iap_status;
 
-    /* Write end in flash */
+    /* Write end (and the Merkle tree over the payload) in flash */
     iap_status = (e_iap_status)write_end();
+    if (iap_status != CMD_SUCCESS)
+        return iap_status;
+
+    /* Write header in flash last, it carries the Merkle root and an archive
+       interrupted before this point has no valid preamble */
+    iap_status = (e_iap_status)write_header();
 
     return iap_status;
 }
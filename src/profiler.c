@@ -0,0 +1,42 @@
+/*
+ * profiler.c
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <string.h>
+#include "profiler.h"
+
+/* declaration of the phase statistics */
+profile_phase verify_profile[PROFILE_PHASES];
+
+/**
+* Clear the statistics of all phases and start the cycle counter
+*/
+void profiler_reset() {
+	uint8_t i;
+
+	timer_init();
+	memset(verify_profile, 0, sizeof(verify_profile));
+	for (i=0; i<PROFILE_PHASES; i++)
+		verify_profile[i].min = 0xFFFFFFFF;
+}
+
+/**
+* Add one occurrence of a phase to its statistics. A phase is only ever recorded
+* from one context at a time (PROFILE_IRQ from the interrupt handler, PROFILE_DMA_IDLE
+* from the handler or from verify with the DMA interrupt masked, the rest from verify).
+*
+* @param phase		Phase that has just ended
+* @param start		Cycle count taken when the phase began
+*/
+void profiler_record(e_profile_phase phase, uint32_t start) {
+	uint32_t cycles = timer_cycles() - start;
+	profile_phase* stats = &verify_profile[phase];
+
+	stats->count++;
+	stats->total += cycles;
+	if (cycles < stats->min) stats->min = cycles;
+	if (cycles > stats->max) stats->max = cycles;
+}
@@ -0,0 +1,56 @@
+/*
+ * timer.c
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include "timer.h"
+
+/* Cortex-M3 debug and trace registers (not every CMSIS release for the LPC17xx defines DWT) */
+#define DEMCR			(*(volatile uint32_t*) 0xE000EDFC)
+#define DEMCR_TRCENA	(1UL << 24)
+#define DWT_CTRL		(*(volatile uint32_t*) 0xE0001000)
+#define DWT_CYCCNT		(*(volatile uint32_t*) 0xE0001004)
+#define DWT_NOCYCCNT	(1UL << 25)
+#define DWT_CYCCNTENA	(1UL << 0)
+
+/* declaration of a variable that indicates whether the DWT cycle counter is used */
+static uint8_t use_cycle_counter = 0;
+
+/**
+* Start counting CPU cycles, using the DWT cycle counter when the core has one and
+* Timer 1 clocked at CCLK otherwise
+*/
+void timer_init() {
+	/* enable trace and check whether the cycle counter is implemented */
+	DEMCR |= DEMCR_TRCENA;
+	if (!(DWT_CTRL & DWT_NOCYCCNT)) {
+		DWT_CYCCNT = 0;
+		DWT_CTRL |= DWT_CYCCNTENA;
+		use_cycle_counter = 1;
+		return;
+	}
+
+	/* power up Timer 1 and clock it with CCLK */
+	LPC_SC->PCONP |= 1 << 2;
+	LPC_SC->PCLKSEL0 = (LPC_SC->PCLKSEL0 & ~(0x03 << 4)) | (0x01 << 4);
+
+	/* count every clock, no match actions */
+	LPC_TIM1->PR = 0;
+	LPC_TIM1->MCR = 0x00;
+
+	/* reset the timer and start it */
+	LPC_TIM1->TCR = 1 << 1;
+	LPC_TIM1->TCR = 1 << 0;
+}
+
+/**
+* Get the number of CPU cycles counted since timer_init (wraps every 2^32 cycles,
+* so differences of two readings are valid across a wrap)
+*
+* @return the 32-bit cycle count
+*/
+uint32_t timer_cycles() {
+	return (use_cycle_counter)? DWT_CYCCNT : LPC_TIM1->TC;
+}
@@ -0,0 +1,277 @@
+/*
+ * verify_log.c
+ *
+ * Verification progress kept in the spare flash sector as an append-only log of
+ * 256-byte records. The newest intact checkpoint or verified record is the current
+ * state, and the newest tuning record holds the DMA control template; the sector
+ * is erased only when it is full.
+ */
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include "md5.h"
+#include "iap_driver.h"
+#include "payload_generator.h"
+#include "definitions.h"
+#include "verify_log.h"
+
+/**
+* Get the log slot at a given index
+*
+* @param slot	Index of the slot in the log sector
+*
+* @return address of the slot
+*/
+static const verify_log_record* verify_log_slot(uint16_t slot) {
+	return (const verify_log_record*) (VERIFY_LOG_ADDRESS + (uint32_t)slot * VERIFY_LOG_RECORD_SIZE);
+}
+
+/**
+* Calculate the digest protecting a record
+*
+* @param record	Record to protect
+* @param digest	Where the digest is stored
+*/
+static void verify_log_record_digest(const verify_log_record* record, uint8_t* digest) {
+	MD5_Digest(record, offsetof(verify_log_record, record_digest), digest);
+}
+
+/**
+* Calculate the digest of the archive header a record is tied to
+*
+* @param digest	Where the digest is stored
+*/
+void verify_log_header_digest(uint8_t* digest) {
+	MD5_Digest(HEADER_ADDRESS, ARCHIVE_HEADER_SIZE, digest);
+}
+
+/**
+* Find the newest intact record of the verification state or of the DMA tuning
+*
+* @param record	Where a copy of the record is stored
+* @param tuning	Look for a tuning record instead of a state record
+*
+* @return found or not found
+*/
+static uint8_t verify_log_newest(verify_log_record* record, uint8_t tuning) {
+	uint16_t slot, used = 0;
+	uint8_t digest[HASH_SIZE];
+
+	/* slots are programmed in order, the first erased one ends the log */
+	while (used < VERIFY_LOG_SLOTS && verify_log_slot(used)->magic != 0xFFFFFFFF)
+		used++;
+
+	/* a torn write leaves a record whose digest does not match, skip it */
+	for (slot=used; slot>0; slot--) {
+		memcpy(record, verify_log_slot(slot - 1), sizeof(*record));
+		verify_log_record_digest(record, digest);
+		if (record->magic == VERIFY_LOG_MAGIC && !memcmp(digest, record->record_digest, HASH_SIZE) &&
+				(record->kind == VERIFY_LOG_DMA_TUNING) == tuning)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+* Find the newest intact record of the verification state (tuning records are
+* skipped, they do not change it)
+*
+* @param record	Where a copy of the record is stored
+*
+* @return found or not found
+*/
+uint8_t verify_log_latest(verify_log_record* record) {
+	return verify_log_newest(record, 0);
+}
+
+/**
+* Append a record to the log, erasing the log sector first when it is full.
+* Flash cannot be read while it is programmed, so nothing may be fetching
+* from it (the DMA must be idle and its interrupt masked).
+*
+* @param record	Record to append (magic and record digest are filled in)
+*
+* @return IAP status codes
+*/
+int verify_log_append(verify_log_record* record) {
+	e_iap_status iap_status;
+	uint16_t slot = 0;
+
+	record->magic = VERIFY_LOG_MAGIC;
+	memset(record->padding, 0xFF, sizeof(record->padding));
+	verify_log_record_digest(record, record->record_digest);
+
+	while (slot < VERIFY_LOG_SLOTS && verify_log_slot(slot)->magic != 0xFFFFFFFF)
+		slot++;
+
+	/* start over in a freshly erased sector */
+	if (slot == VERIFY_LOG_SLOTS) {
+		iap_status = (e_iap_status) iap_prepare_sector(FLASH_USER_LOG_SECTOR, FLASH_USER_LOG_SECTOR);
+		if (iap_status != CMD_SUCCESS)
+			return iap_status;
+		iap_status = (e_iap_status) iap_erase_sector(FLASH_USER_LOG_SECTOR, FLASH_USER_LOG_SECTOR);
+		if (iap_status != CMD_SUCCESS)
+			return iap_status;
+		slot = 0;
+	}
+
+	iap_status = (e_iap_status) iap_prepare_sector(FLASH_USER_LOG_SECTOR, FLASH_USER_LOG_SECTOR);
+	if (iap_status != CMD_SUCCESS)
+		return iap_status;
+
+	return iap_copy_ram_to_flash(record,
+			(void *)(uintptr_t)(FLASH_SECTOR_29_ADDRESS + (uint32_t)slot * VERIFY_LOG_RECORD_SIZE), SIZE_256);
+}
+
+/**
+* Append a record of the current header and the stored hashes verified so far
+*
+* @param kind		VERIFY_LOG_CHECKPOINT or VERIFY_LOG_VERIFIED
+* @param next_part	Parts [0, next_part) have been verified
+* @param hashes		Running digest of the stored hashes of those parts
+*
+* @return IAP status codes
+*/
+int verify_log_save(e_verify_log_kind kind, uint16_t next_part, const MD5_CTX* hashes) {
+	verify_log_record record;
+	MD5_CTX copy = *hashes;
+
+	memset(&record, 0, sizeof(record));
+	record.kind = kind;
+	record.next_part = next_part;
+	verify_log_header_digest(record.header_digest);
+	MD5_Final(record.hashes_digest, &copy);
+
+	return verify_log_append(&record);
+}
+
+/**
+* Check a record against the header and the stored hashes in flash
+*
+* @param record		Record to check
+* @param part_size	Size of a single part
+* @param hashes		Running digest of the stored hashes of the parts the record covers
+*
+* @return the archive still is what the record saw or is not
+*/
+static uint8_t verify_log_matches(const verify_log_record* record, uint32_t part_size, MD5_CTX* hashes) {
+	MD5_CTX copy;
+	uint8_t digest[HASH_SIZE];
+	uint16_t i;
+
+	MD5_Init(hashes);
+	verify_log_header_digest(digest);
+	if (memcmp(digest, record->header_digest, HASH_SIZE)) return 0;
+
+	/* 16 bytes per part instead of the whole part */
+	for (i=0; i<record->next_part; i++)
+		MD5_Update(hashes, PART_STARTING_ADDRESS + (uint32_t)i * part_size, HASH_SIZE);
+	copy = *hashes;
+	MD5_Final(digest, &copy);
+	return !memcmp(digest, record->hashes_digest, HASH_SIZE);
+}
+
+/**
+* Find where an interrupted verification can resume. The newest record must be a
+* checkpoint of this header, and the stored hashes of the parts it covers must
+* still be the ones it saw; those parts are then trusted without re-reading them.
+*
+* @param no_parts	Number of parts in the archive
+* @param part_size	Size of a single part
+* @param hashes		Running digest of stored hashes, continued from the checkpoint
+*
+* @return index of the first part left to verify (0 to start over)
+*/
+uint16_t checkpoint_resume(uint16_t no_parts, uint32_t part_size, MD5_CTX* hashes) {
+	verify_log_record record;
+
+	MD5_Init(hashes);
+	if (!verify_log_latest(&record) || record.kind != VERIFY_LOG_CHECKPOINT) return 0;
+	if (!record.next_part || record.next_part >= no_parts) return 0;
+
+	if (!verify_log_matches(&record, part_size, hashes)) {
+		MD5_Init(hashes);
+		return 0;
+	}
+
+	return record.next_part;
+}
+
+/**
+* Persist verification progress
+*
+* @param next_part	Parts [0, next_part) have been verified (all parts once finished)
+* @param hashes		Running digest of the stored hashes of those parts
+*
+* @return IAP status codes
+*/
+int checkpoint_save(uint16_t next_part, const MD5_CTX* hashes) {
+	return verify_log_save(VERIFY_LOG_CHECKPOINT, next_part, hashes);
+}
+
+/**
+* Check whether the archive is the one last verified valid. The header and
+* every stored hash must be unchanged, which reads 16 bytes per part instead of
+* the whole payload.
+*
+* @param no_parts	Number of parts in the archive
+* @param part_size	Size of a single part
+*
+* @return cached as valid or not cached
+*/
+uint8_t verify_cache_lookup(uint16_t no_parts, uint32_t part_size) {
+	verify_log_record record;
+	MD5_CTX hashes;
+
+	if (!verify_log_latest(&record) || record.kind != VERIFY_LOG_VERIFIED) return 0;
+	if (record.next_part != no_parts) return 0;
+
+	return verify_log_matches(&record, part_size, &hashes);
+}
+
+/**
+* Record that the archive verified valid
+*
+* @param no_parts	Number of parts in the archive
+* @param hashes		Running digest of the stored hashes of all parts
+*
+* @return IAP status codes
+*/
+int verify_cache_store(uint16_t no_parts, const MD5_CTX* hashes) {
+	return verify_log_save(VERIFY_LOG_VERIFIED, no_parts, hashes);
+}
+
+/**
+* Get the DMA control template stored by an earlier autotune
+*
+* @param control	Where the template is stored
+*
+* @return found or not found
+*/
+uint8_t verify_log_tuning(uint32_t* control) {
+	verify_log_record record;
+
+	if (!verify_log_newest(&record, 1)) return 0;
+	*control = record.dma_control;
+	return 1;
+}
+
+/**
+* Store the DMA control template autotune picked
+*
+* @param control	Control template
+*
+* @return IAP status codes
+*/
+int verify_log_save_tuning(uint32_t control) {
+	verify_log_record record;
+
+	memset(&record, 0, sizeof(record));
+	record.kind = VERIFY_LOG_DMA_TUNING;
+	record.dma_control = control;
+
+	return verify_log_append(&record);
+}